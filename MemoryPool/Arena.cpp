@@ -0,0 +1,146 @@
+#include "Arena.h"
+
+#include <stdlib.h>
+
+//Chunk and big block headers take this much, keeping payloads 16-byte aligned.
+const unsigned long ARENA_HEADER_SIZE = 16;
+
+/*==========================================================
+CArena:
+    Constructor of this class for chunks of ulChunkSize bytes from malloc.
+    Nothing is allocated before the first Alloc.
+//=========================================================
+*/
+CArena::CArena(unsigned long ulChunkSize) :
+    m_pChunkPool(NULL),
+    m_ulChunkSize(ulChunkSize < 2 * ARENA_HEADER_SIZE ? 2 * ARENA_HEADER_SIZE : ulChunkSize),
+    m_pFirst(NULL), m_pCurrent(NULL), m_ulOffset(0), m_pBig(NULL), m_ulChunkCount(0)
+{
+}
+
+/*==========================================================
+CArena:
+    Constructor of this class for chunks that are units of ChunkPool, which
+    has to outlive the arena.
+//=========================================================
+*/
+CArena::CArena(CMemPool& ChunkPool) :
+    m_pChunkPool(&ChunkPool), m_ulChunkSize(ChunkPool.GetUnitSize()),
+    m_pFirst(NULL), m_pCurrent(NULL), m_ulOffset(0), m_pBig(NULL), m_ulChunkCount(0)
+{
+}
+
+CArena::~CArena()
+{
+    Release();
+}
+
+/*================================================================
+AllocSlow:
+    Alloc when the current chunk is full: moves on to the next chunk,
+    getting a new one if there is none yet, or gives a request too big for
+    any chunk a block of its own.
+//================================================================
+*/
+void* CArena::AllocSlow(unsigned long ulSize, unsigned long ulAlign)
+{
+    if(ulSize + ulAlign + ARENA_HEADER_SIZE > m_ulChunkSize)
+    {
+        char *pBlock = (char *)malloc(ARENA_HEADER_SIZE + ulSize + ulAlign);
+        if(NULL == pBlock)
+        {
+            return NULL;
+        }
+        struct _BigBlock *pBig = (struct _BigBlock *)pBlock;
+        pBig->pNext = m_pBig;
+        m_pBig = pBig;
+        uintptr_t ulStart = (uintptr_t)pBlock + ARENA_HEADER_SIZE;
+        return (void *)((ulStart + ulAlign - 1) & ~(uintptr_t)(ulAlign - 1));
+    }
+
+    //Chunks kept from before a Reset or Rollback are used again first.
+    struct _Chunk *pNext = (NULL != m_pCurrent) ? m_pCurrent->pNext : m_pFirst;
+    if(NULL == pNext)
+    {
+        pNext = (struct _Chunk *)(NULL != m_pChunkPool ? m_pChunkPool->Alloc(m_ulChunkSize)
+                                                      : malloc(m_ulChunkSize));
+        if(NULL == pNext)
+        {
+            return NULL;
+        }
+        pNext->pNext = NULL;
+        pNext->ulSize = m_ulChunkSize;
+        if(NULL != m_pCurrent)
+        {
+            m_pCurrent->pNext = pNext;
+        }
+        else
+        {
+            m_pFirst = pNext;
+        }
+        m_ulChunkCount++;
+    }
+    m_pCurrent = pNext;
+    m_ulOffset = ARENA_HEADER_SIZE;
+    return Alloc(ulSize, ulAlign);
+}
+
+void CArena::FreeBigBlocks(struct _BigBlock* pUntil)
+{
+    while(m_pBig != pUntil)
+    {
+        struct _BigBlock *pBig = m_pBig;
+        m_pBig = pBig->pNext;
+        free(pBig);
+    }
+}
+
+/*================================================================
+Rollback:
+    Discards everything allocated since mark was taken. The chunks stay
+    for the allocations that follow.
+//================================================================
+*/
+void CArena::Rollback(const Mark& mark)
+{
+    FreeBigBlocks(mark.pBig);
+    m_pCurrent = mark.pChunk;
+    m_ulOffset = mark.ulOffset;
+}
+
+/*================================================================
+Reset:
+    Discards everything allocated so far. The chunks stay for the
+    allocations that follow.
+//================================================================
+*/
+void CArena::Reset()
+{
+    FreeBigBlocks(NULL);
+    m_pCurrent = NULL;
+    m_ulOffset = 0;
+}
+
+/*================================================================
+Release:
+    Discards everything and gives every chunk back to where it came from.
+//================================================================
+*/
+void CArena::Release()
+{
+    Reset();
+    while(NULL != m_pFirst)
+    {
+        struct _Chunk *pChunk = m_pFirst;
+        m_pFirst = pChunk->pNext;
+        if(NULL != m_pChunkPool)
+        {
+            m_pChunkPool->Free(pChunk);
+        }
+        else
+        {
+            free(pChunk);
+        }
+    }
+    m_ulChunkCount = 0;
+}
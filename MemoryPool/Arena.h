@@ -0,0 +1,137 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "MemPool.h"
+
+const unsigned long DEFAULT_ARENA_CHUNK_SIZE = 64 * 1024;
+
+/*==========================================================
+CArena:
+    A bump-pointer (monotonic) allocator for memory that dies all at once,
+    e.g. everything one request allocates. Alloc just moves a pointer
+    forward through the current chunk; there is no per-allocation free.
+    Reset() makes all of it reusable in O(1), Mark()/Rollback() (or a
+    CArenaScope) do the same for everything allocated after the mark.
+
+    The arena grows by fixed-size chunks, which it keeps across Reset and
+    Rollback and only gives back in Release() or its destructor. The chunks
+    come from malloc or, to recycle them between arenas without malloc,
+    from a CMemPool whose unit size is the chunk size. Allocations too big
+    for a chunk get their own malloc block, freed by the Reset or Rollback
+    that discards them.
+
+    An arena is for one thread at a time. Objects put in it with New() are
+    never destroyed, so New() only takes trivially destructible types.
+//=========================================================
+*/
+class CArena
+{
+private:
+    struct _Chunk                   //At the start of every chunk.
+    {
+        struct _Chunk *pNext;       //Chunks stay linked in order, used or not.
+        unsigned long ulSize;
+    };
+    struct _BigBlock                //At the start of every oversized allocation.
+    {
+        struct _BigBlock *pNext;    //Newest first.
+    };
+
+public:
+    //A position in the arena to roll back to.
+    struct Mark
+    {
+        struct _Chunk    *pChunk;
+        unsigned long     ulOffset;
+        struct _BigBlock *pBig;
+    };
+
+    explicit CArena(unsigned long ulChunkSize = DEFAULT_ARENA_CHUNK_SIZE);
+    explicit CArena(CMemPool& ChunkPool);   //Chunks are ChunkPool's units.
+    ~CArena();
+
+    //ulAlign: a power of two. NULL if no memory could be had.
+    void* Alloc(unsigned long ulSize, unsigned long ulAlign = 16);
+    template <typename T, typename... Args>
+    T* New(Args&&... args);
+
+    Mark GetMark() const;
+    void Rollback(const Mark& mark);   //Only to a mark taken since the last Reset.
+    void Reset();                      //O(1) plus one free() per oversized block.
+    void Release();                    //Reset and give back every chunk.
+
+    unsigned long GetChunkCount() const { return m_ulChunkCount; }
+
+private:
+    CArena(const CArena&);
+    CArena& operator=(const CArena&);
+
+    void* AllocSlow(unsigned long ulSize, unsigned long ulAlign);
+    void FreeBigBlocks(struct _BigBlock* pUntil);
+
+    CMemPool*         m_pChunkPool;    //NULL: chunks from malloc.
+    unsigned long     m_ulChunkSize;
+    struct _Chunk    *m_pFirst;
+    struct _Chunk    *m_pCurrent;      //NULL before the first allocation after Reset.
+    unsigned long     m_ulOffset;      //Of the next free byte in m_pCurrent.
+    struct _BigBlock *m_pBig;
+    unsigned long     m_ulChunkCount;
+};
+
+inline void* CArena::Alloc(unsigned long ulSize, unsigned long ulAlign)
+{
+    if(NULL != m_pCurrent)
+    {
+        uintptr_t ulBase = (uintptr_t)m_pCurrent;
+        uintptr_t ulStart = (ulBase + m_ulOffset + ulAlign - 1) & ~(uintptr_t)(ulAlign - 1);
+        if(ulStart + ulSize <= ulBase + m_pCurrent->ulSize)
+        {
+            m_ulOffset = ulStart + ulSize - ulBase;
+            return (void *)ulStart;
+        }
+    }
+    return AllocSlow(ulSize, ulAlign);
+}
+
+template <typename T, typename... Args>
+T* CArena::New(Args&&... args)
+{
+    static_assert(is_trivially_destructible<T>::value,
+                  "CArena never runs destructors, use it for trivially destructible types");
+    void* p = Alloc(sizeof(T), alignof(T));
+    if(NULL == p)
+    {
+        throw bad_alloc();
+    }
+    return new (p) T(std::forward<Args>(args)...);
+}
+
+inline CArena::Mark CArena::GetMark() const
+{
+    Mark mark = { m_pCurrent, m_ulOffset, m_pBig };
+    return mark;
+}
+
+/*==========================================================
+CArenaScope:
+    Rolls the arena back to where it was when the scope was entered.
+//=========================================================
+*/
+class CArenaScope
+{
+public:
+    explicit CArenaScope(CArena& arena) : m_Arena(arena), m_Mark(arena.GetMark()) {}
+    ~CArenaScope() { m_Arena.Rollback(m_Mark); }
+private:
+    CArenaScope(const CArenaScope&);
+    CArenaScope& operator=(const CArenaScope&);
+
+    CArena& m_Arena;
+    CArena::Mark m_Mark;
+};
+
+#endif //__ARENA_H__
@@ -0,0 +1,1261 @@
+#include "MemPool.h"
+
+#include <assert.h>
+#include <execinfo.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+//Payload alignment, the same as malloc gives.
+const unsigned long MEMPOOL_ALIGNMENT = 16;
+
+//The shared batch list packs a version tag into the 16 bits of a pointer
+//that x86-64 and AArch64 user space addresses leave unused.
+const int TAG_SHIFT = 48;
+const uint64_t POINTER_MASK = (1ULL << TAG_SHIFT) - 1;
+
+static atomic<unsigned long> s_NextPoolId(1);
+
+//PopBatch reads the batch link out of a unit that another thread may have
+//just popped and started writing to; the tag check throws such a value
+//away. Keep ThreadSanitizer from reporting that expected race.
+template <typename T>
+#if defined(__SANITIZE_THREAD__)
+__attribute__((no_sanitize("thread"), noinline))
+#endif
+static T LoadNextBatch(const atomic<T>* pLink)
+{
+    return pLink->load(memory_order_relaxed);
+}
+
+//A thread's cache of free units for one pool. The owning thread uses pHead
+//and ulCount without locking; lock only serialises the thread's exit
+//against the pool's destruction, whichever comes first.
+struct CMemPool::_ThreadCache
+{
+    explicit _ThreadCache(CMemPool* pOwner) : pPool(pOwner), pHead(NULL), ulCount(0)
+    {
+        pthread_mutex_init(&lock, NULL);
+        for(int i=0; i<COUNTER_NUM; i++)
+        {
+            ulCounts[i].store(0, memory_order_relaxed);
+        }
+    }
+    ~_ThreadCache()
+    {
+        pthread_mutex_destroy(&lock);
+    }
+
+    pthread_mutex_t lock;
+    CMemPool*       pPool;   //NULL once either side has let go.
+    struct _Unit*   pHead;
+    unsigned long   ulCount;
+    atomic<unsigned long> ulCounts[COUNTER_NUM]; //Written by the owner only.
+};
+
+//Only the owning thread counts, so there is no need for an atomic
+//increment; the counter is atomic for GetStats() to read it.
+static inline void Count(atomic<unsigned long>& ulCounter)
+{
+    ulCounter.store(ulCounter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+//Adds ulUnits to the units out of the shared free lists and raises the
+//high-water mark to match.
+static void TakeOut(atomic<unsigned long>& ulOut, atomic<unsigned long>& ulPeak, unsigned long ulUnits)
+{
+    unsigned long ulNow = ulOut.fetch_add(ulUnits, memory_order_relaxed) + ulUnits;
+    unsigned long ulMax = ulPeak.load(memory_order_relaxed);
+    while(ulNow > ulMax && !ulPeak.compare_exchange_weak(ulMax, ulNow, memory_order_relaxed))
+    {
+    }
+}
+
+//Stores the call stack of CMemPool::Alloc's caller, leaving out this
+//function and Alloc itself.
+static __attribute__((noinline)) void RecordStack(void** pFrames)
+{
+    void *pStack[MEMPOOL_SITE_DEPTH + 2];
+    int iDepth = backtrace(pStack, MEMPOOL_SITE_DEPTH + 2);
+    for(int i=0; i<MEMPOOL_SITE_DEPTH; i++)
+    {
+        pFrames[i] = (i + 2 < iDepth) ? pStack[i + 2] : NULL;
+    }
+}
+
+//Slots in the thread-local lookup table, see _LocalCaches.
+const unsigned long LOCAL_CACHE_SLOTS = 64;
+
+//Every cache the current thread has, by pool id, fronted by a small table
+//indexed by pool id so that a thread working with a handful of pools (say
+//the size classes of one allocator) finds its cache in one compare.
+struct CMemPool::_LocalCaches
+{
+    struct Slot
+    {
+        unsigned long ulId;
+        _ThreadCache* pCache;
+    };
+
+    _LocalCaches()
+    {
+        for(unsigned long i=0; i<LOCAL_CACHE_SLOTS; i++)
+        {
+            Slots[i].ulId = 0;
+            Slots[i].pCache = NULL;
+        }
+    }
+    ~_LocalCaches()
+    {
+        for(size_t i=0; i<Entries.size(); i++)
+        {
+            _ThreadCache *pCache = Entries[i].second.get();
+            pthread_mutex_lock(&pCache->lock);
+            if(NULL != pCache->pPool)
+            {
+                pCache->pPool->Release(pCache);
+            }
+            pthread_mutex_unlock(&pCache->lock);
+        }
+    }
+
+    Slot Slots[LOCAL_CACHE_SLOTS]; //Pool ids are never reused, so a stale slot never matches.
+    vector<pair<unsigned long, shared_ptr<_ThreadCache> > > Entries;
+};
+
+thread_local CMemPool::_LocalCaches CMemPool::s_LocalCaches;
+
+static inline uint64_t Pack(void* p, uint64_t ulTag)
+{
+    return (uint64_t)(uintptr_t)p | (ulTag << TAG_SHIFT);
+}
+
+static inline uint64_t TagOf(uint64_t ulHead)
+{
+    return ulHead >> TAG_SHIFT;
+}
+
+/*==========================================================
+CMemPool:
+    Constructor of this class. It allocate memory block from system; the
+    units in it are handed out as they are needed.
+
+Parameters:
+    [in]ulUnitNum
+    The number of unit which is a part of memory block.
+
+    [in]ulUnitSize
+    The size of unit.
+//=========================================================
+*/
+CMemPool::CMemPool(unsigned long ulUnitNum,unsigned long ulUnitSize, unsigned long ulMaxUnitNum,
+                   unsigned long ulFlags)
+{
+    Init(ulUnitSize);
+    m_ulMaxUnitNum = ulMaxUnitNum;
+    m_ulFlags = ulFlags;
+
+    _ChunkIndex *pIndex = new _ChunkIndex;
+    _Chunk *pChunk = NewChunk(ulUnitNum);     //Allocate a memory block.
+    if(NULL != pChunk)
+    {
+        pIndex->Chunks.push_back(pChunk);
+        m_ulTotalUnits = ulUnitNum;
+    }
+    m_pFirstChunk = pChunk;
+    Publish(pIndex, pChunk);
+}
+
+/*==========================================================
+CMemPool:
+    Constructor of this class for a memory block the caller provides, e.g.
+    a slab of a larger reservation. The pool never frees it. Once it is
+    used up the pool grows by further blocks from pSource, if there is one.
+
+Parameters:
+    [in]pBlock
+    The memory block, aligned to at least 16 bytes.
+
+    [in]ulBlockSize
+    Its size. The pool holds as many units as fit.
+
+    [in]ulUnitSize
+    The size of unit.
+
+    [in]ulFlags
+    MEMPOOL_DEBUG or 0; backing store flags do not apply.
+
+    [in]pSource
+    Supplies more blocks when the pool is full, or NULL to never grow. It
+    must outlive the pool.
+//=========================================================
+*/
+CMemPool::CMemPool(void* pBlock, unsigned long ulBlockSize, unsigned long ulUnitSize,
+                   unsigned long ulFlags, CMemPoolBlockSource* pSource)
+{
+    Init(ulUnitSize);
+    m_ulFlags = ulFlags;
+    m_pBlockSource = pSource;
+
+    _ChunkIndex *pIndex = new _ChunkIndex;
+    unsigned long ulUnitNum = ulBlockSize / m_ulUnitStride;
+    _Chunk *pChunk = (NULL == pBlock || 0 == ulUnitNum) ? NULL : NewChunk(pBlock, ulUnitNum, BACKING_CALLER, ulBlockSize);
+    if(NULL != pChunk)
+    {
+        pIndex->Chunks.push_back(pChunk);
+        m_ulTotalUnits = ulUnitNum;
+    }
+    m_ulMaxUnitNum = NULL == pSource ? m_ulTotalUnits : 0;
+    m_pFirstChunk = pChunk;
+    Publish(pIndex, pChunk);
+}
+
+void CMemPool::Init(unsigned long ulUnitSize)
+{
+    m_ulUnitSize = ulUnitSize;
+    //A free unit has to hold the links.
+    unsigned long ulStride = ulUnitSize < sizeof(struct _Unit) ? sizeof(struct _Unit) : ulUnitSize;
+    m_ulUnitStride = (ulStride + MEMPOOL_ALIGNMENT - 1) & ~(MEMPOOL_ALIGNMENT - 1);
+
+    //Dividing by the stride is then a shift and a multiplication.
+    m_ulStrideShift = __builtin_ctzl(m_ulUnitStride);
+    uint64_t ulOdd = m_ulUnitStride >> m_ulStrideShift;
+    m_ulStrideInverse = ulOdd;                //Right in the low 3 bits,
+    for(int i=0; i<5; i++)                    //each step doubles that.
+    {
+        m_ulStrideInverse *= 2 - ulOdd * m_ulStrideInverse;
+    }
+    m_ulId = s_NextPoolId.fetch_add(1, memory_order_relaxed);
+    m_FreeBatches.store(0, memory_order_relaxed);
+    m_pFreeUnits.store(NULL, memory_order_relaxed);
+    m_pIndex.store(NULL, memory_order_relaxed);
+    m_pCarveChunk.store(NULL, memory_order_relaxed);
+    m_pFirstChunk = NULL;
+    m_ulMaxUnitNum = 0;
+    m_ulFlags = 0;
+    m_ulTotalUnits = 0;
+    m_pBlockSource = NULL;
+    m_ulOutUnits.store(0, memory_order_relaxed);
+    m_ulPeakUnits.store(0, memory_order_relaxed);
+    for(int i=0; i<COUNTER_NUM; i++)
+    {
+        m_ulExitedCounts[i] = 0;
+    }
+    pthread_mutex_init(&m_GrowLock, NULL);
+    pthread_mutex_init(&m_CacheLock, NULL);
+}
+
+/*================================================================
+NewChunk:
+    Allocates a block for ulUnitNum units from the backing store asked for
+    and sets up its bookkeeping. Returns NULL if either fails.
+//================================================================
+*/
+CMemPool::_Chunk* CMemPool::NewChunk(unsigned long ulUnitNum)
+{
+    if(0 == ulUnitNum)
+    {
+        return NULL;
+    }
+    int iBacking;
+    unsigned long ulLength;
+    void *pBlock = AllocPages(ulUnitNum * m_ulUnitStride, m_ulFlags, iBacking, ulLength);
+    return NULL == pBlock ? NULL : NewChunk(pBlock, ulUnitNum, iBacking, ulLength);
+}
+
+//Bookkeeping for a block that is already there. Frees the block again if
+//the bitmap cannot be allocated.
+CMemPool::_Chunk* CMemPool::NewChunk(void* pBase, unsigned long ulUnitNum, int iBacking,
+                                     unsigned long ulLength)
+{
+    //calloc: a large bitmap comes zeroed from fresh pages that are only
+    //committed once a unit they cover is used.
+    atomic<uint64_t> *pOccupied = (atomic<uint64_t> *)calloc((ulUnitNum + 63) / 64, sizeof(uint64_t));
+    if(NULL == pOccupied)
+    {
+        FreePages(pBase, ulLength, iBacking);
+        return NULL;
+    }
+
+    _Site *pSites = NULL;
+    if(0 != (m_ulFlags & MEMPOOL_DEBUG))
+    {
+        pSites = (_Site *)calloc(ulUnitNum, sizeof(_Site));
+        if(NULL == pSites)
+        {
+            free(pOccupied);
+            FreePages(pBase, ulLength, iBacking);
+            return NULL;
+        }
+    }
+
+    _Chunk *pChunk = new _Chunk;
+    pChunk->pBase = (char *)pBase;
+    pChunk->ulUnitNum = ulUnitNum;
+    pChunk->iBacking = iBacking;
+    pChunk->ulLength = ulLength;
+    pChunk->pOccupied = pOccupied;
+    pChunk->ulNextUnit.store(0, memory_order_relaxed);
+    pChunk->pSites = pSites;
+    return pChunk;
+}
+
+void CMemPool::DeleteChunk(_Chunk* pChunk)
+{
+    FreePages(pChunk->pBase, pChunk->ulLength, pChunk->iBacking);
+    free(pChunk->pOccupied);
+    free(pChunk->pSites);
+    delete pChunk;
+}
+
+/*================================================================
+Publish:
+    Makes pIndex the chunk index, sorted by address, and pCarve the chunk to
+    carve from. The old index is kept until no reader can be
+    looking at it. Called from the constructors or with m_GrowLock held.
+//================================================================
+*/
+void CMemPool::Publish(_ChunkIndex* pIndex, _Chunk* pCarve)
+{
+    vector<_Chunk*> &Chunks = pIndex->Chunks;
+    for(size_t i=1; i<Chunks.size(); i++)
+    {
+        for(size_t j=i; j>0 && Chunks[j-1]->pBase > Chunks[j]->pBase; j--)
+        {
+            swap(Chunks[j-1], Chunks[j]);
+        }
+    }
+
+    //Index first: a thread that sees the new carve chunk must find the
+    //units it carves from it in the index.
+    _ChunkIndex *pOld = m_pIndex.exchange(pIndex, memory_order_acq_rel);
+    m_pCarveChunk.store(pCarve, memory_order_release);
+    if(NULL != pOld)
+    {
+        m_RetiredIndexes.push_back(pOld);
+    }
+}
+
+/*================================================================
+Grow:
+    Adds a chunk as large as the whole pool so far, within the limit, or
+    the next block of the block source. Returns false if the pool may not or
+    cannot grow.
+//================================================================
+*/
+bool CMemPool::Grow()
+{
+    pthread_mutex_lock(&m_GrowLock);
+
+    //Another thread may have grown the pool while we waited.
+    _Chunk *pCarve = m_pCarveChunk.load(memory_order_acquire);
+    if(NULL != pCarve && pCarve->ulNextUnit.load(memory_order_relaxed) < pCarve->ulUnitNum)
+    {
+        pthread_mutex_unlock(&m_GrowLock);
+        return true;
+    }
+
+    unsigned long ulUnitNum = 0;
+    _Chunk *pChunk = NULL;
+    if(NULL != m_pBlockSource)
+    {
+        unsigned long ulBlockSize = 0;
+        void *pBlock = m_pBlockSource->GetBlock(this, ulBlockSize);
+        ulUnitNum = ulBlockSize / m_ulUnitStride;
+        if(NULL != pBlock && 0 != ulUnitNum)
+        {
+            pChunk = NewChunk(pBlock, ulUnitNum, BACKING_CALLER, ulBlockSize);
+        }
+    }
+    else
+    {
+        ulUnitNum = m_ulTotalUnits < MEMPOOL_BATCH_SIZE ? MEMPOOL_BATCH_SIZE : m_ulTotalUnits;
+        if(0 != m_ulMaxUnitNum && ulUnitNum > m_ulMaxUnitNum - m_ulTotalUnits)
+        {
+            ulUnitNum = m_ulMaxUnitNum - m_ulTotalUnits;
+        }
+        pChunk = NewChunk(ulUnitNum);
+    }
+    if(NULL == pChunk)
+    {
+        pthread_mutex_unlock(&m_GrowLock);
+        return false;
+    }
+
+    _ChunkIndex *pIndex = new _ChunkIndex(*m_pIndex.load(memory_order_relaxed));
+    pIndex->Chunks.push_back(pChunk);
+    Publish(pIndex, pChunk);
+    m_ulTotalUnits += ulUnitNum;
+
+    pthread_mutex_unlock(&m_GrowLock);
+    return true;
+}
+
+/*================================================================
+FindChunk:
+    The chunk p is a unit of, with the unit's index in ulIndex, or NULL.
+//================================================================
+*/
+CMemPool::_Chunk* CMemPool::FindChunk(const void* p, uint64_t& ulIndex) const
+{
+    const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+    if(Chunks.empty())
+    {
+        return NULL;
+    }
+
+    //The last chunk starting at or before p.
+    size_t lo = 0, hi = Chunks.size();
+    while(hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if((uintptr_t)Chunks[mid]->pBase <= (uintptr_t)p)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    ulIndex = UnitIndex(Chunks[lo], p);
+    return ulIndex < Chunks[lo]->ulUnitNum ? Chunks[lo] : NULL;
+}
+
+/*================================================================
+UnitIndex:
+    The index of the unit p points at in pChunk, or a number not below its
+    ulUnitNum if p is not the start of one of its units. For odd d,
+    x * (1/d) mod 2^64 is x / d when d divides x and larger than any such
+    quotient otherwise, so one compare rejects pointers into the middle of
+    a unit as well as ones outside the chunk.
+//================================================================
+*/
+uint64_t CMemPool::UnitIndex(const _Chunk* pChunk, const void* p) const
+{
+    uint64_t ulOffset = (uintptr_t)p - (uintptr_t)pChunk->pBase;
+    if(0 != (ulOffset & ((1UL << m_ulStrideShift) - 1)))
+    {
+        return pChunk->ulUnitNum;
+    }
+    return (ulOffset >> m_ulStrideShift) * m_ulStrideInverse;
+}
+
+
+/*===============================================================
+~CMemPool():
+    Destructor of this class. It detaches every thread cache, so threads
+    exiting later leave the pool alone, and frees the chunks. In debug mode
+    it reports the units that were never freed first.
+//===============================================================
+*/
+CMemPool::~CMemPool()
+{
+    if(0 != (m_ulFlags & MEMPOOL_DEBUG))
+    {
+        ReportLeaks(stderr);
+    }
+
+    vector<shared_ptr<_ThreadCache> > Caches;
+    pthread_mutex_lock(&m_CacheLock);
+    Caches.swap(m_Caches);
+    pthread_mutex_unlock(&m_CacheLock);
+
+    //A thread exiting right now holds its cache lock until it is done with us.
+    for(size_t i=0; i<Caches.size(); i++)
+    {
+        pthread_mutex_lock(&Caches[i]->lock);
+        Caches[i]->pPool = NULL;
+        pthread_mutex_unlock(&Caches[i]->lock);
+    }
+
+    _ChunkIndex *pIndex = m_pIndex.load(memory_order_relaxed);
+    for(size_t i=0; i<pIndex->Chunks.size(); i++)
+    {
+        DeleteChunk(pIndex->Chunks[i]);
+    }
+    delete pIndex;
+    for(size_t i=0; i<m_RetiredIndexes.size(); i++)
+    {
+        delete m_RetiredIndexes[i];
+    }
+    pthread_mutex_destroy(&m_GrowLock);
+    pthread_mutex_destroy(&m_CacheLock);
+}
+
+/*================================================================
+Alloc:
+    To allocate a memory unit. If memory pool can`t provide proper memory unit,
+    even after growing, It will call system function.
+
+Parameters:
+    [in]ulSize
+    Memory unit size.
+
+    [in]bUseMemPool
+    Whether use memory pool.
+
+Return Values:
+    Return a pointer to a memory unit.
+//=================================================================
+*/
+void* CMemPool::Alloc(unsigned long ulSize, bool bUseMemPool)
+{
+    _ThreadCache *pCache = LocalCache();
+    if(ulSize > m_ulUnitSize || false == bUseMemPool)
+    {
+        Count(pCache->ulCounts[COUNT_MALLOC_ALLOCS]);
+        return malloc(ulSize);
+    }
+
+    if(NULL == pCache->pHead)
+    {
+        Refill(pCache);
+        if(NULL == pCache->pHead)
+        {
+            Count(pCache->ulCounts[COUNT_MALLOC_ALLOCS]);
+            return malloc(ulSize);             //Every unit is in use.
+        }
+    }
+
+    struct _Unit *pCurUnit = pCache->pHead;
+    pCache->pHead = pCurUnit->pNext;
+    pCache->ulCount--;
+
+    uint64_t ulIndex = 0;
+    _Chunk *pChunk = FindChunk(pCurUnit, ulIndex);
+    pChunk->pOccupied[ulIndex / 64].fetch_or(1ULL << (ulIndex % 64), memory_order_relaxed);
+    Count(pCache->ulCounts[COUNT_ALLOCS]);
+    if(NULL != pChunk->pSites)
+    {
+        pChunk->pSites[ulIndex].lTime = monotonic_ns();
+        RecordStack(pChunk->pSites[ulIndex].pFrames);
+    }
+    return (void *)pCurUnit;
+}
+
+
+/*================================================================
+Free:
+    To free a memory unit. If the pointer of parameter point to a memory unit,
+    then put it in this thread's cache. Otherwise, call system function "free".
+
+Parameters:
+    [in]p
+    It point to a memory unit and prepare to free it.
+
+Return Values:
+    none
+//================================================================
+*/
+void CMemPool::Free( void* p )
+{
+    uint64_t ulIndex = 0;
+    _Chunk *pChunk = FindChunk(p, ulIndex);
+    if(NULL != pChunk)
+    {
+        uint64_t ulBit = 1ULL << (ulIndex % 64);
+        uint64_t ulWord = pChunk->pOccupied[ulIndex / 64].fetch_and(~ulBit, memory_order_relaxed);
+        assert(0 != (ulWord & ulBit) && "CMemPool::Free: unit freed twice");
+        (void)ulWord;
+
+        struct _Unit *pCurUnit = (struct _Unit *)p;
+        _ThreadCache *pCache = LocalCache();
+        Count(pCache->ulCounts[COUNT_FREES]);
+        pCurUnit->pNext = pCache->pHead;
+        pCache->pHead = pCurUnit;
+        if(++pCache->ulCount >= 2*MEMPOOL_BATCH_SIZE)
+        {
+            Flush(pCache);
+        }
+    }
+    else if(NULL != p)
+    {
+        Count(LocalCache()->ulCounts[COUNT_MALLOC_FREES]);
+        free(p);
+    }
+}
+
+/*================================================================
+LocalCache:
+    Finds the calling thread's cache for this pool, creating it on the
+    thread's first Alloc or Free.
+//================================================================
+*/
+CMemPool::_ThreadCache* CMemPool::LocalCache()
+{
+    _LocalCaches &Local = s_LocalCaches;
+    _LocalCaches::Slot &CurSlot = Local.Slots[m_ulId % LOCAL_CACHE_SLOTS];
+    if(CurSlot.ulId == m_ulId)
+    {
+        return CurSlot.pCache;
+    }
+
+    _ThreadCache *pFound = NULL;
+    for(size_t i=0; i<Local.Entries.size() && NULL == pFound; i++)
+    {
+        if(Local.Entries[i].first == m_ulId)
+        {
+            pFound = Local.Entries[i].second.get();
+        }
+    }
+
+    if(NULL == pFound)
+    {
+        //Forget caches of pools that have been destroyed meanwhile.
+        for(size_t i=0; i<Local.Entries.size(); )
+        {
+            _ThreadCache *pCache = Local.Entries[i].second.get();
+            pthread_mutex_lock(&pCache->lock);
+            bool bOrphaned = (NULL == pCache->pPool);
+            pthread_mutex_unlock(&pCache->lock);
+            if(bOrphaned)
+            {
+                Local.Entries[i] = Local.Entries.back();
+                Local.Entries.pop_back();
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        shared_ptr<_ThreadCache> pCache = make_shared<_ThreadCache>(this);
+        pthread_mutex_lock(&m_CacheLock);
+        m_Caches.push_back(pCache);
+        pthread_mutex_unlock(&m_CacheLock);
+        Local.Entries.push_back(make_pair(m_ulId, pCache));
+        pFound = pCache.get();
+    }
+
+    CurSlot.ulId = m_ulId;
+    CurSlot.pCache = pFound;
+    return pFound;
+}
+
+/*================================================================
+Refill:
+    Gives an empty cache a full batch from the shared list or, failing that,
+    all the leftover units or, failing that, units never used before.
+//================================================================
+*/
+void CMemPool::Refill(_ThreadCache* pCache)
+{
+    struct _Unit *pBatch = PopBatch();
+    if(NULL != pBatch)
+    {
+        pCache->pHead = pBatch;
+        pCache->ulCount = MEMPOOL_BATCH_SIZE;
+        TakeOut(m_ulOutUnits, m_ulPeakUnits, MEMPOOL_BATCH_SIZE);
+        return;
+    }
+
+    //Taking the whole list at once cannot suffer from ABA.
+    struct _Unit *pUnits = m_pFreeUnits.exchange(NULL, memory_order_acquire);
+    unsigned long ulCount = 0;
+    for(struct _Unit *pCurUnit = pUnits; NULL != pCurUnit; pCurUnit = pCurUnit->pNext)
+    {
+        ulCount++;
+    }
+    if(NULL == pUnits)
+    {
+        pUnits = Carve(ulCount);
+    }
+    //Other threads may carve up a new chunk before we get to it.
+    while(NULL == pUnits && Grow())
+    {
+        pUnits = Carve(ulCount);
+    }
+    pCache->pHead = pUnits;
+    pCache->ulCount = ulCount;
+    TakeOut(m_ulOutUnits, m_ulPeakUnits, ulCount);
+}
+
+/*================================================================
+Carve:
+    Claims up to a batch of units of the newest chunk that have never been
+    handed out and links them. Returns NULL once the whole chunk is in use.
+//================================================================
+*/
+struct CMemPool::_Unit* CMemPool::Carve(unsigned long& ulCount)
+{
+    ulCount = 0;
+    _Chunk *pChunk = m_pCarveChunk.load(memory_order_acquire);
+    if(NULL == pChunk || pChunk->ulNextUnit.load(memory_order_relaxed) >= pChunk->ulUnitNum)
+    {
+        return NULL;
+    }
+    unsigned long ulFirst = pChunk->ulNextUnit.fetch_add(MEMPOOL_BATCH_SIZE, memory_order_relaxed);
+    if(ulFirst >= pChunk->ulUnitNum)
+    {
+        return NULL;
+    }
+    unsigned long ulEnd = ulFirst + MEMPOOL_BATCH_SIZE;
+    if(ulEnd > pChunk->ulUnitNum)
+    {
+        ulEnd = pChunk->ulUnitNum;
+    }
+
+    struct _Unit *pHead = NULL;
+    for(unsigned long i=ulEnd; i>ulFirst; i--)
+    {
+        struct _Unit *pCurUnit = new (pChunk->pBase + (i-1)*m_ulUnitStride) _Unit;
+        pCurUnit->pNext = pHead;
+        pHead = pCurUnit;
+    }
+    ulCount = ulEnd - ulFirst;
+    return pHead;
+}
+
+/*================================================================
+Flush:
+    Keeps the most recently freed batch in a full cache, which is the one
+    most likely to still be in the CPU cache, and gives the other back.
+//================================================================
+*/
+void CMemPool::Flush(_ThreadCache* pCache)
+{
+    m_ulOutUnits.fetch_sub(pCache->ulCount - MEMPOOL_BATCH_SIZE, memory_order_relaxed);
+    struct _Unit *pLastKept = pCache->pHead;
+    for(unsigned long i=1; i<MEMPOOL_BATCH_SIZE; i++)
+    {
+        pLastKept = pLastKept->pNext;
+    }
+    struct _Unit *pBatch = pLastKept->pNext;
+    pLastKept->pNext = NULL;
+    pCache->ulCount -= MEMPOOL_BATCH_SIZE;
+
+    //The rest is one full batch, unless the cache had taken in more leftovers
+    //than that; then it all goes back as leftovers.
+    if(MEMPOOL_BATCH_SIZE == pCache->ulCount)
+    {
+        PushBatch(pBatch);
+        return;
+    }
+    struct _Unit *pTail = pBatch;
+    while(NULL != pTail->pNext)
+    {
+        pTail = pTail->pNext;
+    }
+    PushUnits(pBatch, pTail);
+    pCache->ulCount = MEMPOOL_BATCH_SIZE;
+}
+
+/*================================================================
+Release:
+    Hands the cache of an exiting thread back to the pool. Called with the
+    cache's lock held.
+//================================================================
+*/
+void CMemPool::Release(_ThreadCache* pCache)
+{
+    if(NULL != pCache->pHead)
+    {
+        struct _Unit *pTail = pCache->pHead;
+        while(NULL != pTail->pNext)
+        {
+            pTail = pTail->pNext;
+        }
+        PushUnits(pCache->pHead, pTail);
+    }
+    m_ulOutUnits.fetch_sub(pCache->ulCount, memory_order_relaxed);
+    pCache->pHead = NULL;
+    pCache->ulCount = 0;
+    pCache->pPool = NULL;
+
+    pthread_mutex_lock(&m_CacheLock);
+    for(int i=0; i<COUNTER_NUM; i++)
+    {
+        m_ulExitedCounts[i] += pCache->ulCounts[i].load(memory_order_relaxed);
+    }
+    for(size_t i=0; i<m_Caches.size(); i++)
+    {
+        if(m_Caches[i].get() == pCache)
+        {
+            m_Caches[i] = m_Caches.back();
+            m_Caches.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_CacheLock);
+}
+
+void CMemPool::PushBatch(struct _Unit* pBatch)
+{
+    uint64_t ulHead = m_FreeBatches.load(memory_order_relaxed);
+    uint64_t ulNewHead;
+    do
+    {
+        pBatch->pNextBatch.store((struct _Unit *)(uintptr_t)(ulHead & POINTER_MASK),
+                                 memory_order_relaxed);
+        ulNewHead = Pack(pBatch, TagOf(ulHead) + 1);
+    } while(!m_FreeBatches.compare_exchange_weak(ulHead, ulNewHead, memory_order_release,
+                                                 memory_order_relaxed));
+}
+
+struct CMemPool::_Unit* CMemPool::PopBatch()
+{
+    uint64_t ulHead = m_FreeBatches.load(memory_order_acquire);
+    for(;;)
+    {
+        struct _Unit *pBatch = (struct _Unit *)(uintptr_t)(ulHead & POINTER_MASK);
+        if(NULL == pBatch)
+        {
+            return NULL;
+        }
+        //pBatch may be taken and pushed again meanwhile; the tag makes the
+        //exchange fail then, so a stale pNextBatch is never installed.
+        struct _Unit *pNextBatch = LoadNextBatch(&pBatch->pNextBatch);
+        if(m_FreeBatches.compare_exchange_weak(ulHead, Pack(pNextBatch, TagOf(ulHead) + 1),
+                                               memory_order_acquire, memory_order_acquire))
+        {
+            return pBatch;
+        }
+    }
+}
+
+//Moves every unit of pList to the front of pOnto and returns the result.
+struct CMemPool::_Unit* CMemPool::Prepend(struct _Unit* pList, struct _Unit* pOnto)
+{
+    while(NULL != pList)
+    {
+        struct _Unit *pCurUnit = pList;
+        pList = pList->pNext;
+        pCurUnit->pNext = pOnto;
+        pOnto = pCurUnit;
+    }
+    return pOnto;
+}
+
+void CMemPool::PushUnits(struct _Unit* pHead, struct _Unit* pTail)
+{
+    struct _Unit *pOldHead = m_pFreeUnits.load(memory_order_relaxed);
+    do
+    {
+        pTail->pNext = pOldHead;
+    } while(!m_pFreeUnits.compare_exchange_weak(pOldHead, pHead, memory_order_release,
+                                                memory_order_relaxed));
+}
+
+/*================================================================
+Contains:
+    Whether p is a unit of this pool that is currently allocated. O(1).
+//================================================================
+*/
+bool CMemPool::Contains(const void* p) const
+{
+    uint64_t ulIndex = 0;
+    _Chunk *pChunk = FindChunk(p, ulIndex);
+    return NULL != pChunk &&
+        0 != (pChunk->pOccupied[ulIndex / 64].load(memory_order_relaxed) & (1ULL << (ulIndex % 64)));
+}
+
+/*================================================================
+CountLiveUnits:
+    The number of units allocated and not freed yet, e.g. to check for leaks
+    before the pool goes away. Exact only while no other thread is using
+    the pool.
+//================================================================
+*/
+unsigned long CMemPool::CountLiveUnits() const
+{
+    unsigned long ulLive = 0;
+    const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+    for(size_t i=0; i<Chunks.size(); i++)
+    {
+        ulLive += CountLiveUnits(Chunks[i]);
+    }
+    return ulLive;
+}
+
+unsigned long CMemPool::CountLiveUnits(const _Chunk* pChunk)
+{
+    unsigned long ulUsed = pChunk->ulNextUnit.load(memory_order_relaxed);
+    if(ulUsed > pChunk->ulUnitNum)
+    {
+        ulUsed = pChunk->ulUnitNum;
+    }
+    unsigned long ulLive = 0;
+    for(unsigned long i=0; i<(ulUsed + 63) / 64; i++)
+    {
+        ulLive += __builtin_popcountll(pChunk->pOccupied[i].load(memory_order_relaxed));
+    }
+    return ulLive;
+}
+
+int CMemPool::GetBacking() const
+{
+    return NULL == m_pFirstChunk ? BACKING_MALLOC : m_pFirstChunk->iBacking;
+}
+
+/*================================================================
+Trim:
+    Gives grown chunks without a single allocated unit back to the system.
+    All free units, including the ones in thread caches, are gathered and
+    the free lists are rebuilt from those that stay, so no other thread may
+    use the pool while this runs. The chunk the pool started with stays.
+
+Return Values:
+    The number of chunks freed.
+//================================================================
+*/
+unsigned long CMemPool::Trim()
+{
+    pthread_mutex_lock(&m_GrowLock);
+
+    _ChunkIndex *pIndex = m_pIndex.load(memory_order_relaxed);
+    vector<_Chunk*> Released;
+    _ChunkIndex *pKept = new _ChunkIndex;
+    for(size_t i=0; i<pIndex->Chunks.size(); i++)
+    {
+        _Chunk *pChunk = pIndex->Chunks[i];
+        if(BACKING_CALLER != pChunk->iBacking && pChunk != m_pFirstChunk && 0 == CountLiveUnits(pChunk))
+        {
+            Released.push_back(pChunk);
+        }
+        else
+        {
+            pKept->Chunks.push_back(pChunk);
+        }
+    }
+    if(Released.empty())
+    {
+        delete pKept;
+        pthread_mutex_unlock(&m_GrowLock);
+        return 0;
+    }
+
+    //Gather every free unit: the batches, the leftovers and the caches.
+    struct _Unit *pAll = NULL;
+    struct _Unit *pBatch;
+    while(NULL != (pBatch = PopBatch()))
+    {
+        pAll = Prepend(pBatch, pAll);
+    }
+    pAll = Prepend(m_pFreeUnits.exchange(NULL, memory_order_acquire), pAll);
+    pthread_mutex_lock(&m_CacheLock);
+    for(size_t i=0; i<m_Caches.size(); i++)
+    {
+        pAll = Prepend(m_Caches[i]->pHead, pAll);
+        m_Caches[i]->pHead = NULL;
+        m_Caches[i]->ulCount = 0;
+    }
+    pthread_mutex_unlock(&m_CacheLock);
+
+    //Put back the ones in chunks that stay, in batches again.
+    pBatch = NULL;
+    struct _Unit *pBatchTail = NULL;
+    unsigned long ulBatchCount = 0;
+    while(NULL != pAll)
+    {
+        struct _Unit *pCurUnit = pAll;
+        pAll = pAll->pNext;
+        uint64_t ulIndex = 0;
+        _Chunk *pChunk = FindChunk(pCurUnit, ulIndex);
+        if(find(Released.begin(), Released.end(), pChunk) != Released.end())
+        {
+            continue;
+        }
+        if(NULL == pBatch)
+        {
+            pBatchTail = pCurUnit;
+        }
+        pCurUnit->pNext = pBatch;
+        pBatch = pCurUnit;
+        if(++ulBatchCount == MEMPOOL_BATCH_SIZE)
+        {
+            PushBatch(pBatch);
+            pBatch = NULL;
+            ulBatchCount = 0;
+        }
+    }
+    if(NULL != pBatch)
+    {
+        PushUnits(pBatch, pBatchTail);
+    }
+
+    //Nobody else is looking at any index now, old ones can go.
+    _Chunk *pCarve = m_pCarveChunk.load(memory_order_relaxed);
+    if(find(Released.begin(), Released.end(), pCarve) != Released.end())
+    {
+        pCarve = NULL;                  //Only this one could have units never handed out.
+    }
+    Publish(pKept, pCarve);
+    for(size_t i=0; i<m_RetiredIndexes.size(); i++)
+    {
+        delete m_RetiredIndexes[i];
+    }
+    m_RetiredIndexes.clear();
+    m_ulOutUnits.store(CountLiveUnits(), memory_order_relaxed); //The caches are empty now.
+    for(size_t i=0; i<Released.size(); i++)
+    {
+        m_ulTotalUnits -= Released[i]->ulUnitNum;
+        DeleteChunk(Released[i]);
+    }
+
+    pthread_mutex_unlock(&m_GrowLock);
+    return Released.size();
+}
+
+/*================================================================
+GetStats:
+    The pool's counters, summed over every thread that used it, and its
+    size and occupancy now.
+//================================================================
+*/
+MemPoolStats CMemPool::GetStats() const
+{
+    MemPoolStats Stats;
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.ulUnitSize = m_ulUnitSize;
+    const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+    Stats.ulChunks = Chunks.size();
+    for(size_t i=0; i<Chunks.size(); i++)
+    {
+        Stats.ulTotalUnits += Chunks[i]->ulUnitNum;
+    }
+
+    unsigned long ulCounts[COUNTER_NUM];
+    pthread_mutex_lock(const_cast<pthread_mutex_t *>(&m_CacheLock));
+    for(int i=0; i<COUNTER_NUM; i++)
+    {
+        ulCounts[i] = m_ulExitedCounts[i];
+        for(size_t j=0; j<m_Caches.size(); j++)
+        {
+            ulCounts[i] += m_Caches[j]->ulCounts[i].load(memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(const_cast<pthread_mutex_t *>(&m_CacheLock));
+
+    Stats.ulAllocs = ulCounts[COUNT_ALLOCS];
+    Stats.ulFrees = ulCounts[COUNT_FREES];
+    Stats.ulMallocAllocs = ulCounts[COUNT_MALLOC_ALLOCS];
+    Stats.ulMallocFrees = ulCounts[COUNT_MALLOC_FREES];
+    Stats.ulLiveUnits = CountLiveUnits();
+    Stats.ulPeakUnits = m_ulPeakUnits.load(memory_order_relaxed);
+    return Stats;
+}
+
+/*================================================================
+CollectSites:
+    The allocation sites of all live units, each with the number of live
+    units allocated there and the time of the oldest, most units first.
+    Empty unless the pool is in debug mode.
+//================================================================
+*/
+void CMemPool::CollectSites(vector<pair<_Site, unsigned long> >& Sites) const
+{
+    vector<_Site> Live;
+    const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+    for(size_t i=0; i<Chunks.size(); i++)
+    {
+        const _Chunk *pChunk = Chunks[i];
+        for(unsigned long j=0; NULL != pChunk->pSites && j<pChunk->ulUnitNum; j++)
+        {
+            if(0 != (pChunk->pOccupied[j / 64].load(memory_order_relaxed) & (1ULL << (j % 64))))
+            {
+                Live.push_back(pChunk->pSites[j]);
+            }
+        }
+    }
+
+    struct SameStack
+    {
+        bool operator()(const _Site& a, const _Site& b) const
+        {
+            return memcmp(a.pFrames, b.pFrames, sizeof(a.pFrames)) < 0;
+        }
+    };
+    sort(Live.begin(), Live.end(), SameStack());
+    Sites.clear();
+    for(size_t i=0; i<Live.size(); i++)
+    {
+        if(Sites.empty() || 0 != memcmp(Sites.back().first.pFrames, Live[i].pFrames, sizeof(Live[i].pFrames)))
+        {
+            Sites.push_back(make_pair(Live[i], 0UL));
+        }
+        Sites.back().second++;
+        Sites.back().first.lTime = min(Sites.back().first.lTime, Live[i].lTime);
+    }
+
+    struct MostUnits
+    {
+        bool operator()(const pair<_Site, unsigned long>& a, const pair<_Site, unsigned long>& b) const
+        {
+            return a.second > b.second;
+        }
+    };
+    stable_sort(Sites.begin(), Sites.end(), MostUnits());
+}
+
+static int CountFrames(void* const* pFrames)
+{
+    int iDepth = 0;
+    while(iDepth < MEMPOOL_SITE_DEPTH && NULL != pFrames[iDepth])
+    {
+        iDepth++;
+    }
+    return iDepth;
+}
+
+/*================================================================
+ReportLeaks:
+    Writes the units still allocated to pFile, if there are any: in debug
+    mode grouped by allocation site, otherwise the first few addresses.
+
+Return Values:
+    The number of units still allocated.
+//================================================================
+*/
+unsigned long CMemPool::ReportLeaks(FILE* pFile) const
+{
+    unsigned long ulLive = CountLiveUnits();
+    if(0 == ulLive)
+    {
+        return 0;
+    }
+    fprintf(pFile, "CMemPool: %lu units of %lu bytes still allocated\n", ulLive, m_ulUnitSize);
+
+    vector<pair<_Site, unsigned long> > Sites;
+    CollectSites(Sites);
+    long lNow = monotonic_ns();
+    for(size_t i=0; i<Sites.size(); i++)
+    {
+        fprintf(pFile, "  %lu allocated at (oldest %.3f s ago):\n", Sites[i].second,
+                (lNow - Sites[i].first.lTime) / 1e9);
+        int iDepth = CountFrames(Sites[i].first.pFrames);
+        char **pszSymbols = backtrace_symbols(Sites[i].first.pFrames, iDepth);
+        for(int j=0; j<iDepth; j++)
+        {
+            if(NULL != pszSymbols)
+            {
+                fprintf(pFile, "    %s\n", pszSymbols[j]);
+            }
+            else
+            {
+                fprintf(pFile, "    %p\n", Sites[i].first.pFrames[j]);
+            }
+        }
+        free(pszSymbols);
+    }
+
+    if(Sites.empty())
+    {
+        const unsigned long MAX_LISTED = 10;
+        unsigned long ulListed = 0;
+        const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+        for(size_t i=0; i<Chunks.size() && ulListed < MAX_LISTED; i++)
+        {
+            for(unsigned long j=0; j<Chunks[i]->ulUnitNum && ulListed < MAX_LISTED; j++)
+            {
+                if(0 != (Chunks[i]->pOccupied[j / 64].load(memory_order_relaxed) & (1ULL << (j % 64))))
+                {
+                    fprintf(pFile, "  %p\n", (void *)(Chunks[i]->pBase + j*m_ulUnitStride));
+                    ulListed++;
+                }
+            }
+        }
+        if(ulListed < ulLive)
+        {
+            fprintf(pFile, "  ... (allocation sites are recorded with MEMPOOL_DEBUG)\n");
+        }
+    }
+    return ulLive;
+}
+
+static void WriteJsonString(FILE* pFile, const char* sz)
+{
+    fputc('"', pFile);
+    for(; '\0' != *sz; sz++)
+    {
+        if('"' == *sz || '\\' == *sz)
+        {
+            fputc('\\', pFile);
+        }
+        if((unsigned char)*sz >= ' ')
+        {
+            fputc(*sz, pFile);
+        }
+    }
+    fputc('"', pFile);
+}
+
+/*================================================================
+Dump:
+    Writes the pool as one JSON object: the statistics, then every chunk
+    with its occupancy bitmap up to the last unit ever handed out, as 16
+    hex digits per 64 units (unit 0 is the lowest bit of the first group),
+    then, in debug mode, the allocation sites of the live units.
+//================================================================
+*/
+void CMemPool::Dump(FILE* pFile) const
+{
+    static const char* const s_szBackings[] = {"caller", "malloc", "pages", "THP", "hugetlb"};
+
+    MemPoolStats Stats = GetStats();
+    fprintf(pFile, "{\"unit_size\":%lu,\"unit_stride\":%lu,\"total_units\":%lu,\"allocs\":%lu,"
+            "\"frees\":%lu,\"malloc_allocs\":%lu,\"malloc_frees\":%lu,\"live_units\":%lu,"
+            "\"peak_units\":%lu,\n\"chunks\":[",
+            Stats.ulUnitSize, m_ulUnitStride, Stats.ulTotalUnits, Stats.ulAllocs, Stats.ulFrees,
+            Stats.ulMallocAllocs, Stats.ulMallocFrees, Stats.ulLiveUnits, Stats.ulPeakUnits);
+
+    const vector<_Chunk*> &Chunks = m_pIndex.load(memory_order_acquire)->Chunks;
+    for(size_t i=0; i<Chunks.size(); i++)
+    {
+        const _Chunk *pChunk = Chunks[i];
+        unsigned long ulUsed = min(pChunk->ulNextUnit.load(memory_order_relaxed), pChunk->ulUnitNum);
+        fprintf(pFile, "%s\n{\"base\":\"%p\",\"units\":%lu,\"carved\":%lu,\"live\":%lu,"
+                "\"backing\":\"%s\",\"occupancy\":\"",
+                0 == i ? "" : ",", (void *)pChunk->pBase, pChunk->ulUnitNum, ulUsed,
+                CountLiveUnits(pChunk), s_szBackings[pChunk->iBacking]);
+        for(unsigned long j=0; j<(ulUsed + 63) / 64; j++)
+        {
+            fprintf(pFile, "%016llx", (unsigned long long)pChunk->pOccupied[j].load(memory_order_relaxed));
+        }
+        fprintf(pFile, "\"}");
+    }
+
+    fprintf(pFile, "],\n\"sites\":[");
+    vector<pair<_Site, unsigned long> > Sites;
+    CollectSites(Sites);
+    long lNow = monotonic_ns();
+    for(size_t i=0; i<Sites.size(); i++)
+    {
+        fprintf(pFile, "%s\n{\"units\":%lu,\"oldest_age_ns\":%ld,\"frames\":[", 0 == i ? "" : ",",
+                Sites[i].second, lNow - Sites[i].first.lTime);
+        int iDepth = CountFrames(Sites[i].first.pFrames);
+        char **pszSymbols = backtrace_symbols(Sites[i].first.pFrames, iDepth);
+        for(int j=0; j<iDepth; j++)
+        {
+            if(0 != j)
+            {
+                fputc(',', pFile);
+            }
+            if(NULL != pszSymbols)
+            {
+                WriteJsonString(pFile, pszSymbols[j]);
+            }
+            else
+            {
+                fprintf(pFile, "\"%p\"", Sites[i].first.pFrames[j]);
+            }
+        }
+        free(pszSymbols);
+        fprintf(pFile, "]}");
+    }
+    fprintf(pFile, "]}\n");
+}
+
+int CMemPool::Dump(const char* szPath) const
+{
+    FILE *pFile = fopen(szPath, "w");
+    if(NULL == pFile)
+    {
+        return -1;
+    }
+    Dump(pFile);
+    return 0 == fclose(pFile) ? 0 : -1;
+}
@@ -0,0 +1,239 @@
+#ifndef __MEMPOOL_H__
+#define __MEMPOOL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "../ThreadPool/Platform.h"
+#include "PageAlloc.h"
+
+using namespace std;
+
+//Units handed between a thread's cache and the shared free list at a time.
+const unsigned long MEMPOOL_BATCH_SIZE = 32;
+
+//CMemPool flag, next to the backing store ones in PageAlloc.h: record the
+//call stack of every allocation, for ReportLeaks() and Dump().
+const unsigned long MEMPOOL_DEBUG = 8;
+const int MEMPOOL_SITE_DEPTH = 6; //Frames recorded per allocation.
+
+//What GetStats() returns. The counters cover the pool's whole life.
+struct MemPoolStats
+{
+    unsigned long ulUnitSize;
+    unsigned long ulTotalUnits;   //In all chunks.
+    unsigned long ulChunks;
+    unsigned long ulAllocs;       //Units handed out.
+    unsigned long ulFrees;        //Units given back.
+    unsigned long ulMallocAllocs; //Requests passed on to malloc: too big, or no unit left.
+    unsigned long ulMallocFrees;  //Pointers passed on to free.
+    unsigned long ulLiveUnits;    //Allocated now.
+    unsigned long ulPeakUnits;    //High-water mark of units out of the shared free lists.
+};
+
+class CMemPool;
+
+//Hands more caller-owned memory to a pool that was built on such memory,
+//see the CMemPool constructor taking a block.
+class CMemPoolBlockSource
+{
+public:
+    virtual ~CMemPoolBlockSource() {}
+    //Another block for pPool, aligned to at least 16 bytes, with its size in
+    //ulBlockSize; NULL if there is none. Called with the pool's grow lock held.
+    virtual void* GetBlock(CMemPool* pPool, unsigned long& ulBlockSize) = 0;
+};
+
+/*==========================================================
+CMemPool:
+    A fixed-size memory pool that any number of threads can use at once.
+
+    Every thread keeps a small cache (a "magazine") of free units, so Alloc
+    and Free normally touch nothing but thread-local data. A cache that runs
+    dry takes a whole batch of MEMPOOL_BATCH_SIZE units from the shared free
+    list, and one that grows past two batches gives a batch back, so the
+    shared list sees one atomic operation per batch instead of one per unit.
+    The shared list is a lock-free stack of batches whose head carries a
+    version tag in the top 16 bits of the pointer, so a stale head can never
+    be swapped back in (ABA). Units freed by another thread than the one that
+    allocated them simply go into the freeing thread's cache.
+
+    Allocated units carry no header: the free list links live inside the
+    free units themselves, and an occupancy bitmap (one bit per unit) records
+    which units are out. Contains(p) is a range check, a multiplication and a
+    bit test, and Free asserts that it is not given a unit twice.
+
+    Units are carved out of the block a batch at a time, the first time they
+    are needed, so only the part of a large block that has actually been used
+    is ever touched (and, for a fresh mapping, committed).
+
+    When every unit is in use the pool grows by another chunk as large as the
+    whole pool so far, until it holds ulMaxUnitNum units; only then does Alloc
+    fall back to malloc. A pool over caller memory grows only if it was given
+    a CMemPoolBlockSource, by whatever blocks that hands out. A sorted chunk
+    index, replaced as a whole whenever it changes, lets Free find the owning
+    chunk with a short binary search (none at all while there is a single
+    chunk). Trim() gives grown chunks that are entirely free back to the
+    system.
+
+    By default chunks come from malloc. With ulFlags they can be mapped
+    instead (MEMPOOL_MMAP), on huge pages (MEMPOOL_HUGE_PAGES) to spare the
+    TLB for large pools, and faulted in up front (MEMPOOL_PREFAULT) so that
+    first use costs no page faults. Huge pages fall back to transparent huge
+    pages and then to regular ones; GetBacking() tells what was used.
+
+    GetStats() sums counters that every thread keeps in its own cache, so
+    keeping them costs no shared writes. The high-water mark is kept per
+    batch: it counts units in thread caches as well as allocated ones. With
+    MEMPOOL_DEBUG the pool records the call stack of every allocation as
+    well, and ReportLeaks() groups the units still allocated by where they
+    came from; the destructor reports them by itself then. Dump() writes the
+    statistics, every chunk's occupancy bitmap and, in debug mode, the
+    allocation sites of live units as JSON, for looking into fragmentation
+    and leaks after the fact.
+
+    A thread's cache goes back to the pool when the thread exits. Units that
+    are still cached by other threads when the pool is destroyed are dropped
+    with it.
+//=========================================================
+*/
+class CMemPool
+{
+private:
+    //What a free unit holds; an allocated unit is all payload.
+    struct _Unit
+    {
+        struct _Unit *pNext;                  //Next free unit in the same batch or cache.
+        atomic<struct _Unit*> pNextBatch;     //Next batch on the shared free list.
+    };
+
+    //Where a unit was allocated, with MEMPOOL_DEBUG.
+    struct _Site
+    {
+        long  lTime;                          //monotonic_ns()
+        void* pFrames[MEMPOOL_SITE_DEPTH];
+    };
+
+    //A block of units: the one the pool starts with, or one it grew by.
+    struct _Chunk
+    {
+        char*             pBase;
+        unsigned long     ulUnitNum;
+        int               iBacking;    //PageBacking; anything but BACKING_CALLER is ours to free.
+        unsigned long     ulLength;    //Bytes allocated, for FreePages.
+        atomic<uint64_t>* pOccupied;   //One bit per unit, set while the unit is allocated.
+        atomic<unsigned long> ulNextUnit; //First unit never handed out.
+        _Site*            pSites;      //One per unit with MEMPOOL_DEBUG, else NULL.
+    };
+
+    //Every chunk, sorted by address. Never changed once published.
+    struct _ChunkIndex
+    {
+        vector<_Chunk*> Chunks;
+    };
+
+    struct _ThreadCache;
+    struct _LocalCaches;
+
+    //What every thread cache counts, see GetStats().
+    enum { COUNT_ALLOCS, COUNT_FREES, COUNT_MALLOC_ALLOCS, COUNT_MALLOC_FREES, COUNTER_NUM };
+
+    unsigned long    m_ulUnitSize; //Memory unit size. There are much unit in memory pool.
+    unsigned long    m_ulUnitStride;//Distance between two units.
+    unsigned long    m_ulStrideShift;  //m_ulUnitStride is m_ulStrideOdd << m_ulStrideShift,
+    uint64_t         m_ulStrideInverse;//and this is m_ulStrideOdd's inverse mod 2^64.
+    unsigned long    m_ulId;       //Tells this pool's caches apart in the thread-local table.
+
+    //Shared lock-free free lists, each on its own cache line.
+    alignas(CACHE_LINE_SIZE) atomic<uint64_t> m_FreeBatches; //Tagged head of full batches.
+    alignas(CACHE_LINE_SIZE) atomic<struct _Unit*> m_pFreeUnits; //Leftovers, fewer than a batch each.
+
+    //Read on every Alloc and Free, written only when the pool grows or trims.
+    alignas(CACHE_LINE_SIZE) atomic<_ChunkIndex*> m_pIndex;
+    atomic<_Chunk*> m_pCarveChunk;    //The chunk that may still have units never handed out.
+    _Chunk*         m_pFirstChunk;    //The one the pool was created with; Trim keeps it.
+
+    //Growing and trimming, serialised by m_GrowLock.
+    pthread_mutex_t  m_GrowLock;
+    unsigned long    m_ulMaxUnitNum;  //0: no limit.
+    unsigned long    m_ulFlags;       //Backing store for new chunks.
+    unsigned long    m_ulTotalUnits;  //In all chunks.
+    CMemPoolBlockSource* m_pBlockSource; //Where a pool over caller memory grows from, or NULL.
+    vector<_ChunkIndex*> m_RetiredIndexes; //Replaced, but a reader may still be looking.
+
+    //Units out of the shared free lists, changed a batch at a time.
+    alignas(CACHE_LINE_SIZE) atomic<unsigned long> m_ulOutUnits;
+    atomic<unsigned long> m_ulPeakUnits;
+
+    //Every thread cache of this pool, only touched when a thread starts or
+    //stops using the pool.
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t m_CacheLock;
+    vector<shared_ptr<_ThreadCache> > m_Caches;
+    unsigned long    m_ulExitedCounts[COUNTER_NUM]; //Of caches released so far.
+
+    static thread_local _LocalCaches s_LocalCaches;
+
+    CMemPool(const CMemPool&);
+    CMemPool& operator=(const CMemPool&);
+
+    _ThreadCache* LocalCache();
+    void Init(unsigned long ulUnitSize);
+    _Chunk* NewChunk(unsigned long ulUnitNum);
+    _Chunk* NewChunk(void* pBase, unsigned long ulUnitNum, int iBacking, unsigned long ulLength);
+    void DeleteChunk(_Chunk* pChunk);
+    void Publish(_ChunkIndex* pIndex, _Chunk* pCarve);
+    bool Grow();
+    _Chunk* FindChunk(const void* p, uint64_t& ulIndex) const;
+    uint64_t UnitIndex(const _Chunk* pChunk, const void* p) const;
+    static unsigned long CountLiveUnits(const _Chunk* pChunk);
+    void Refill(_ThreadCache* pCache);
+    struct _Unit* Carve(unsigned long& ulCount);
+    void Flush(_ThreadCache* pCache);
+    void Release(_ThreadCache* pCache);
+    void PushBatch(struct _Unit* pBatch);
+    struct _Unit* PopBatch();
+    void PushUnits(struct _Unit* pHead, struct _Unit* pTail);
+    static struct _Unit* Prepend(struct _Unit* pList, struct _Unit* pOnto);
+    void CollectSites(vector<pair<_Site, unsigned long> >& Sites) const;
+
+public:
+    //ulMaxUnitNum: grow up to this many units in all (0: no limit; lUnitNum: never grow)
+    //ulFlags: MEMPOOL_MMAP, MEMPOOL_HUGE_PAGES, MEMPOOL_PREFAULT, MEMPOOL_DEBUG
+    CMemPool(unsigned long lUnitNum = 50, unsigned long lUnitSize = 1024,
+             unsigned long ulMaxUnitNum = 0, unsigned long ulFlags = 0);
+    //Pool over memory the caller owns and keeps alive longer than the pool.
+    //It grows only by blocks from pSource. ulFlags: MEMPOOL_DEBUG
+    CMemPool(void* pBlock, unsigned long ulBlockSize, unsigned long ulUnitSize,
+             unsigned long ulFlags = 0, CMemPoolBlockSource* pSource = NULL);
+    ~CMemPool();
+
+    void* Alloc(unsigned long ulSize, bool bUseMemPool = true); //Allocate memory unit
+    void Free( void* p );                                   //Free memory unit
+
+    bool Contains(const void* p) const; //p is a unit of this pool that is allocated now
+    unsigned long CountLiveUnits() const;
+    unsigned long GetUnitSize() const { return m_ulUnitSize; }
+    int GetBacking() const; //PageBacking of the first chunk; grown ones may have fallen back further
+
+    MemPoolStats GetStats() const;
+    //Lists what is still allocated, by allocation site with MEMPOOL_DEBUG.
+    //Returns the number of live units.
+    unsigned long ReportLeaks(FILE* pFile = stderr) const;
+    //JSON snapshot of statistics, occupancy and allocation sites. Dump(path)
+    //returns -1 if the file cannot be written. Exact only while no other
+    //thread is using the pool.
+    int Dump(const char* szPath) const;
+    void Dump(FILE* pFile) const;
+
+    //Frees grown chunks that have no unit allocated and returns how many.
+    //Meant for quiet periods: no other thread may use the pool meanwhile.
+    unsigned long Trim();
+};
+
+#endif //__MEMPOOL_H__
@@ -0,0 +1,456 @@
+#include "MemPool.h"
+#include "SizeClassAlloc.h"
+#include "../ThreadPool/MPMCQueue.h"
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Benchmarks for CMemPool and CSizeClassAlloc against the system malloc.
+//
+//   MemPool_Bench [-t max_threads] [-n ops] [-o results.jsonl] [-q]
+//
+// Workloads:
+//   churn          one thread allocating and freeing small fixed-size blocks
+//   cross_thread   producer threads allocate, consumer threads free what
+//                  they are handed through a queue
+//   random_sizes   every thread replaces random blocks of a live set with
+//                  blocks of random size, 16 to 1024 bytes, log-uniform
+//   fragmentation  one thread, long run: the live set is rebuilt over and
+//                  over with a size mix that keeps shifting
+//
+// Every workload runs in a child process of its own, so that the RSS it
+// reports is its own and not what earlier runs left behind. A result gives
+// ns per operation (an allocation plus its free), the latency of single
+// allocations (every SAMPLE_EVERY-th one is timed, clock read included),
+// the RSS at the end of the run and the peak RSS. The threaded workloads
+// run with 2, 4, ... up to max_threads threads (default: the number of
+// online CPUs, at least 2); with -t 1 they run single-threaded, except for
+// cross_thread, which runs producer/consumer pairs and so only runs with an
+// even thread count. With -o every result is also appended as one
+// JSON object per line. -q shrinks the workloads for a quick smoke run.
+
+const long DEFAULT_BENCH_OPS = 4000000;
+const int SAMPLE_EVERY = 16;
+const unsigned long CHURN_SIZE = 64;
+const int CHURN_DEPTH = 8;               // blocks live at once in churn
+const unsigned long MIN_RANDOM_SIZE = 16;
+const unsigned long MAX_RANDOM_SIZE = 1024;
+const int LIVE_SET = 4096;               // blocks live per thread in random_sizes
+const int FRAGMENTATION_LIVE_SET = 100000;
+const int QUEUE_CAPACITY = 1024;
+
+struct BenchConfig
+{
+  int max_threads;
+  long ops;
+  FILE* json; // NULL: no machine-readable output
+};
+
+// The allocators under test, behind one interface so that every workload
+// pays the same virtual call.
+class BenchAllocator
+{
+public:
+  virtual ~BenchAllocator() {}
+  virtual void* alloc(unsigned long size) = 0;
+  virtual void free(void* p) = 0;
+};
+
+class MallocAllocator : public BenchAllocator
+{
+public:
+  void* alloc(unsigned long size) { return ::malloc(size); }
+  void free(void* p) { ::free(p); }
+};
+
+// A fixed unit size: every request of a random size mix takes a whole unit
+class MemPoolAllocator : public BenchAllocator
+{
+public:
+  explicit MemPoolAllocator(unsigned long unit_size) : m_pool(1024, unit_size) {}
+  void* alloc(unsigned long size) { return m_pool.Alloc(size); }
+  void free(void* p) { m_pool.Free(p); }
+private:
+  CMemPool m_pool;
+};
+
+class SizeClassAllocator : public BenchAllocator
+{
+public:
+  void* alloc(unsigned long size) { return m_alloc.Alloc(size); }
+  void free(void* p) { m_alloc.Free(p); }
+private:
+  CSizeClassAlloc m_alloc;
+};
+
+const int NUM_ALLOCATORS = 3;
+static const char* const ALLOCATOR_NAMES[NUM_ALLOCATORS] = {"malloc", "mempool", "size_class"};
+
+static BenchAllocator* make_allocator(int which, unsigned long max_size)
+{
+  switch (which) {
+  case 0:
+    return new MallocAllocator;
+  case 1:
+    return new MemPoolAllocator(max_size);
+  default:
+    return new SizeClassAllocator;
+  }
+}
+
+// What one thread measured
+struct ThreadResult
+{
+  long ops;
+  vector<long> samples; // ns per timed allocation
+};
+
+static long percentile(vector<long>& samples, double p)
+{
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = (size_t) (p * (samples.size() - 1));
+  nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+// Resident set size now and at its peak, in kB, from /proc/self/status
+static void read_rss(long& rss_kb, long& peak_kb)
+{
+  rss_kb = peak_kb = 0;
+  FILE* file = fopen("/proc/self/status", "r");
+  if (file == NULL) {
+    return;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    sscanf(line, "VmRSS: %ld kB", &rss_kb);
+    sscanf(line, "VmHWM: %ld kB", &peak_kb);
+  }
+  fclose(file);
+}
+
+static void report(const BenchConfig& config, const char* bench, const char* impl, int threads,
+                   vector<ThreadResult>& results, double seconds)
+{
+  long ops = 0;
+  vector<long> samples;
+  for (size_t i = 0; i < results.size(); i++) {
+    ops += results[i].ops;
+    samples.insert(samples.end(), results[i].samples.begin(), results[i].samples.end());
+  }
+  // every result's thread (or producer and consumer pair) ran for the whole
+  // time, so this is how long one op took it
+  double ns_per_op = seconds * 1e9 * results.size() / ops;
+  long p50 = percentile(samples, 0.50);
+  long p99 = percentile(samples, 0.99);
+  long p999 = percentile(samples, 0.999);
+  long rss_kb, peak_kb;
+  read_rss(rss_kb, peak_kb);
+
+  printf("%-14s %-10s threads %3d  %7.1f ns/op  p50 %5ld p99 %6ld p999 %7ld ns  "
+         "rss %8ld kB  peak %8ld kB\n",
+         bench, impl, threads, ns_per_op, p50, p99, p999, rss_kb, peak_kb);
+  if (config.json != NULL) {
+    fprintf(config.json, "{\"bench\":\"%s\",\"impl\":\"%s\",\"threads\":%d,\"ops\":%ld,"
+            "\"seconds\":%.6f,\"ns_per_op\":%.2f,\"p50_ns\":%ld,\"p99_ns\":%ld,\"p999_ns\":%ld,"
+            "\"rss_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+            bench, impl, threads, ops, seconds, ns_per_op, p50, p99, p999, rss_kb, peak_kb);
+  }
+}
+
+// Allocates, timing every SAMPLE_EVERY-th call, and touches the block
+static inline void* timed_alloc(BenchAllocator& allocator, unsigned long size, long op,
+                                ThreadResult& result)
+{
+  void* p;
+  if (op % SAMPLE_EVERY == 0) {
+    long start = monotonic_ns();
+    p = allocator.alloc(size);
+    result.samples.push_back(monotonic_ns() - start);
+  } else {
+    p = allocator.alloc(size);
+  }
+  *(volatile char*) p = 1;
+  return p;
+}
+
+// CHURN_DEPTH blocks at a time, freed in the opposite order
+static void bench_churn(const BenchConfig& config, BenchAllocator& allocator, const char* impl)
+{
+  vector<ThreadResult> results(1);
+  results[0].samples.reserve(config.ops / SAMPLE_EVERY + 1);
+  void* blocks[CHURN_DEPTH];
+  long start = monotonic_ns();
+  for (long op = 0; op < config.ops; op += CHURN_DEPTH) {
+    for (int i = 0; i < CHURN_DEPTH; i++) {
+      blocks[i] = timed_alloc(allocator, CHURN_SIZE, op + i, results[0]);
+    }
+    for (int i = CHURN_DEPTH - 1; i >= 0; i--) {
+      allocator.free(blocks[i]);
+    }
+  }
+  double seconds = (monotonic_ns() - start) / 1e9;
+  results[0].ops = config.ops - config.ops % CHURN_DEPTH;
+  report(config, "churn", impl, 1, results, seconds);
+}
+
+// Half the threads allocate and hand their blocks to a consumer each, the
+// other half free them: no block is freed by the thread that allocated it.
+static void bench_cross_thread(const BenchConfig& config, BenchAllocator& allocator,
+                               const char* impl, int threads)
+{
+  int pairs = threads / 2; // threads is even
+  long ops_per_pair = config.ops / pairs;
+  vector<MPMCQueue<void*>*> queues;
+  for (int i = 0; i < pairs; i++) {
+    queues.push_back(new MPMCQueue<void*>(QUEUE_CAPACITY));
+  }
+  vector<ThreadResult> results(pairs);
+
+  vector<thread> workers;
+  long start = monotonic_ns();
+  for (int i = 0; i < pairs; i++) {
+    MPMCQueue<void*>* queue = queues[i];
+    ThreadResult* result = &results[i];
+    result->samples.reserve(ops_per_pair / SAMPLE_EVERY + 1);
+    result->ops = ops_per_pair;
+    workers.push_back(thread([&allocator, queue, result, ops_per_pair] {
+      for (long op = 0; op < ops_per_pair; op++) {
+        void* p = timed_alloc(allocator, CHURN_SIZE, op, *result);
+        while (!queue->try_enqueue(move(p))) {
+          sched_yield();
+        }
+      }
+    }));
+    workers.push_back(thread([&allocator, queue, ops_per_pair] {
+      void* p;
+      for (long op = 0; op < ops_per_pair; op++) {
+        while (!queue->try_dequeue(p)) {
+          sched_yield();
+        }
+        allocator.free(p);
+      }
+    }));
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  double seconds = (monotonic_ns() - start) / 1e9;
+  report(config, "cross_thread", impl, pairs * 2, results, seconds);
+  for (int i = 0; i < pairs; i++) {
+    delete queues[i];
+  }
+}
+
+// Sizes from MIN_RANDOM_SIZE to max_size, spread evenly over the powers of
+// two in between (log-uniform), so small blocks are as common as they are in
+// real programs and no single size dominates the mix.
+static unsigned long random_size(mt19937& random, unsigned long max_size)
+{
+  double fraction = random() / (random.max() + 1.0); // [0, 1)
+  double ratio = (max_size + 1.0) / MIN_RANDOM_SIZE;
+  unsigned long size = (unsigned long) (MIN_RANDOM_SIZE * pow(ratio, fraction));
+  return min(size, max_size); // only guards against rounding
+}
+
+static void replace_random(BenchAllocator& allocator, vector<void*>& live, long ops,
+                           unsigned long max_size, mt19937& random, ThreadResult& result)
+{
+  for (long op = 0; op < ops; op++) {
+    size_t slot = random() % live.size();
+    allocator.free(live[slot]);
+    live[slot] = timed_alloc(allocator, random_size(random, max_size), op, result);
+  }
+}
+
+static void bench_random_sizes(const BenchConfig& config, BenchAllocator& allocator,
+                               const char* impl, int threads)
+{
+  long ops_per_thread = config.ops / threads;
+  vector<ThreadResult> results(threads);
+  vector<vector<void*> > live(threads);
+  for (int t = 0; t < threads; t++) {
+    mt19937 random(t);
+    ThreadResult warmup;
+    for (int i = 0; i < LIVE_SET; i++) {
+      live[t].push_back(timed_alloc(allocator, random_size(random, MAX_RANDOM_SIZE), 1, warmup));
+    }
+  }
+
+  vector<thread> workers;
+  long start = monotonic_ns();
+  for (int t = 0; t < threads; t++) {
+    results[t].ops = ops_per_thread;
+    results[t].samples.reserve(ops_per_thread / SAMPLE_EVERY + 1);
+    workers.push_back(thread([&allocator, &live, &results, t, ops_per_thread] {
+      mt19937 random(1000 + t);
+      replace_random(allocator, live[t], ops_per_thread, MAX_RANDOM_SIZE, random, results[t]);
+    }));
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  double seconds = (monotonic_ns() - start) / 1e9;
+  report(config, "random_sizes", impl, threads, results, seconds);
+  for (int t = 0; t < threads; t++) {
+    for (size_t i = 0; i < live[t].size(); i++) {
+      allocator.free(live[t][i]);
+    }
+  }
+}
+
+// Ten phases; in each the largest size in the mix changes, and the whole
+// live set is replaced a few times over. Blocks from earlier phases that
+// survive keep holes open, which is what drives RSS up in a general
+// allocator. RSS is read with the last live set still allocated.
+static void bench_fragmentation(const BenchConfig& config, BenchAllocator& allocator,
+                                const char* impl)
+{
+  const int PHASES = 10;
+  static const unsigned long phase_max_size[PHASES] = {
+    64, 1024, 128, 512, 32, 1024, 256, 96, 768, 48
+  };
+  vector<ThreadResult> results(1);
+  results[0].ops = 0;
+  results[0].samples.reserve(config.ops / SAMPLE_EVERY + 1);
+  mt19937 random(7);
+  vector<void*> live;
+  for (int i = 0; i < FRAGMENTATION_LIVE_SET; i++) {
+    live.push_back(allocator.alloc(random_size(random, phase_max_size[0])));
+  }
+
+  long start = monotonic_ns();
+  for (int phase = 0; phase < PHASES; phase++) {
+    long ops = config.ops / PHASES;
+    replace_random(allocator, live, ops, phase_max_size[phase], random, results[0]);
+    results[0].ops += ops;
+  }
+  double seconds = (monotonic_ns() - start) / 1e9;
+  report(config, "fragmentation", impl, 1, results, seconds);
+  for (size_t i = 0; i < live.size(); i++) {
+    allocator.free(live[i]);
+  }
+}
+
+// Runs one workload in a child process and waits for it
+template <typename Function>
+static void run_isolated(const BenchConfig& config, Function fn)
+{
+  fflush(stdout);
+  if (config.json != NULL) {
+    fflush(config.json);
+  }
+  pid_t child = fork();
+  if (child < 0) {
+    fprintf(stderr, "fork failed: %s\n", strerror(errno));
+    return;
+  }
+  if (child == 0) {
+    fn();
+    fflush(stdout);
+    if (config.json != NULL) {
+      fflush(config.json);
+    }
+    _exit(0);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "benchmark process failed (status %d)\n", status);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  BenchConfig config;
+  config.max_threads = max((int) sysconf(_SC_NPROCESSORS_ONLN), 2);
+  config.ops = DEFAULT_BENCH_OPS;
+  config.json = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:o:q")) != -1) {
+    switch (opt) {
+    case 't':
+      config.max_threads = atoi(optarg);
+      break;
+    case 'n':
+      config.ops = atol(optarg);
+      break;
+    case 'o':
+      config.json = fopen(optarg, "a");
+      if (config.json == NULL) {
+        fprintf(stderr, "cannot open %s: %s\n", optarg, strerror(errno));
+        return 1;
+      }
+      break;
+    case 'q':
+      config.ops = 200000;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t max_threads] [-n ops] [-o results.jsonl] [-q]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (config.max_threads < 1 || config.ops < CHURN_DEPTH) {
+    fprintf(stderr, "-t must be positive and -n at least %d\n", CHURN_DEPTH);
+    return 1;
+  }
+
+  for (int which = 0; which < NUM_ALLOCATORS; which++) {
+    const char* impl = ALLOCATOR_NAMES[which];
+    run_isolated(config, [&config, which, impl] {
+      BenchAllocator* allocator = make_allocator(which, CHURN_SIZE);
+      bench_churn(config, *allocator, impl);
+      delete allocator;
+    });
+    run_isolated(config, [&config, which, impl] {
+      BenchAllocator* allocator = make_allocator(which, MAX_RANDOM_SIZE);
+      bench_fragmentation(config, *allocator, impl);
+      delete allocator;
+    });
+  }
+
+  for (int threads = min(2, config.max_threads); ; threads *= 2) {
+    if (threads > config.max_threads) {
+      threads = config.max_threads;
+    }
+    for (int which = 0; which < NUM_ALLOCATORS; which++) {
+      const char* impl = ALLOCATOR_NAMES[which];
+      if (threads % 2 == 0) { // pairs; odd counts were covered one step down
+        run_isolated(config, [&config, which, impl, threads] {
+          BenchAllocator* allocator = make_allocator(which, CHURN_SIZE);
+          bench_cross_thread(config, *allocator, impl, threads);
+          delete allocator;
+        });
+      }
+      run_isolated(config, [&config, which, impl, threads] {
+        BenchAllocator* allocator = make_allocator(which, MAX_RANDOM_SIZE);
+        bench_random_sizes(config, *allocator, impl, threads);
+        delete allocator;
+      });
+    }
+    if (threads == config.max_threads) {
+      break;
+    }
+  }
+
+  if (config.json != NULL) {
+    fclose(config.json);
+  }
+  return 0;
+}
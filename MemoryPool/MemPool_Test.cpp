@@ -0,0 +1,120 @@
+#include "Arena.h"
+#include "MemPool.h"
+#include "ObjectPool.h"
+#include "PoolAllocator.h"
+#include "SizeClassAlloc.h"
+
+#include <string.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+const int NUM_THREADS = 4;
+const int ROUNDS = 100000;
+const unsigned long UNIT_SIZE = 64;
+
+class CTestClass
+{
+public:
+  explicit CTestClass(int id) : m_id(id) {}
+  int id() const { return m_id; }
+private:
+  int m_id;
+  char m_chBuf[60];
+};
+
+int main()
+{
+  CMemPool pool(1024, UNIT_SIZE);
+
+  // every thread allocates a few units, scribbles over them and frees them,
+  // mostly through its own cache
+  vector<thread> threads;
+  for (int t = 0; t < NUM_THREADS; t++) {
+    threads.push_back(thread([&pool, t] {
+      void* units[8];
+      for (int i = 0; i < ROUNDS; i++) {
+        for (int j = 0; j < 8; j++) {
+          units[j] = pool.Alloc(UNIT_SIZE);
+          memset(units[j], t, UNIT_SIZE);
+        }
+        for (int j = 0; j < 8; j++) {
+          pool.Free(units[j]);
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  // a unit freed by another thread than the one that allocated it
+  void* p = pool.Alloc(UNIT_SIZE);
+  thread([&pool, p] { pool.Free(p); }).join();
+
+  // too big for a unit: served by malloc
+  void* big = pool.Alloc(4 * UNIT_SIZE);
+  pool.Free(big);
+
+  // counters summed over every thread; ReportLeaks() lists whatever is
+  // still allocated (by call stack with MEMPOOL_DEBUG) and returns how much
+  MemPoolStats stats = pool.GetStats();
+  cout << stats.ulAllocs << " allocations, " << stats.ulMallocAllocs << " passed on to malloc, at most "
+       << stats.ulPeakUnits << " units out at once, " << pool.ReportLeaks() << " leaked" << endl;
+
+  // a burst larger than the pool: it grows by chunks instead of calling
+  // malloc, and Trim() hands them back once the burst is over
+  CMemPool growing(16, UNIT_SIZE);
+  vector<void*> burst;
+  for (int i = 0; i < 1000; i++) {
+    burst.push_back(growing.Alloc(UNIT_SIZE));
+  }
+  for (size_t i = 0; i < burst.size(); i++) {
+    growing.Free(burst[i]);
+  }
+  cout << "Trimmed " << growing.Trim() << " chunks" << endl;
+
+  // a big pool on huge pages, all faulted in before first use; falls back
+  // to transparent huge pages or regular pages when it has to
+  static const char* const backings[] = {"caller", "malloc", "pages", "THP", "hugetlb"};
+  CMemPool mapped(1 << 16, UNIT_SIZE, 1 << 16, MEMPOOL_HUGE_PAGES | MEMPOOL_PREFAULT);
+  cout << "Huge page pool is backed by " << backings[mapped.GetBacking()] << endl;
+
+  // any size: rounded up to a size class, or malloc above the largest
+  CSizeClassAlloc alloc;
+  void* small = alloc.Alloc(24);   // from the 32-byte class
+  void* large = alloc.Alloc(100000);
+  cout << "24 bytes come from the " << CSizeClassAlloc::ClassSize(CSizeClassAlloc::SizeClassOf(24))
+       << "-byte class" << endl;
+  alloc.Free(small);
+  alloc.Free(large);
+
+  // typed objects, constructed in place and handed back by the unique_ptr
+  ObjectPool<CTestClass> objects;
+  ObjectPool<CTestClass>::Ptr obj = objects.make(42);
+  cout << "Object " << obj->id() << " lives in the pool: " << objects.owns(obj.get()) << endl;
+
+  // containers allocate their nodes from size classes instead of malloc
+  map<int, string, less<int>, PoolAllocator<pair<const int, string> > > names;
+  names[1] = "one";
+  names[2] = "two";
+  cout << "Map of " << names.size() << " pooled nodes" << endl;
+
+  // per-request scratch memory: bump allocations, dropped all at once
+  CArena arena(4096);
+  for (int request = 0; request < 100; request++) {
+    CArenaScope scope(arena);
+    for (int i = 0; i < 50; i++) {
+      memset(arena.Alloc(100), request, 100);
+    }
+  }
+  cout << "Arena served 100 requests from " << arena.GetChunkCount() << " chunks" << endl;
+
+  cout << "Done" << endl;
+  return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef __OBJECTPOOL_H__
+#define __OBJECTPOOL_H__
+
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "MemPool.h"
+
+/*==========================================================
+ObjectPool<T>:
+    Typed front end to a CMemPool of sizeof(T) units. make() constructs a T
+    in place in a pool unit and returns a unique_ptr that destroys it and
+    gives the unit back to the pool, e.g.
+
+        ObjectPool<CTestClass> pool;
+        ObjectPool<CTestClass>::Ptr p = pool.make(arg1, arg2);
+
+    construct()/destroy() do the same for raw pointers. Both construct() and
+    make() throw bad_alloc if the pool has no unit left and malloc fails
+    too. Like CMemPool it can be used from any number of threads, and the
+    pool must outlive every object made from it.
+//=========================================================
+*/
+template <typename T>
+class ObjectPool
+{
+public:
+    static_assert(alignof(T) <= 16, "CMemPool units are only 16-byte aligned");
+
+    class Deleter
+    {
+    public:
+        Deleter() : m_pPool(NULL) {}
+        explicit Deleter(ObjectPool* pPool) : m_pPool(pPool) {}
+        void operator()(T* p) const { m_pPool->destroy(p); }
+    private:
+        ObjectPool* m_pPool;
+    };
+    typedef unique_ptr<T, Deleter> Ptr;
+
+    //The CMemPool arguments: initial and maximum object count, backing store.
+    explicit ObjectPool(unsigned long ulUnitNum = 64, unsigned long ulMaxUnitNum = 0,
+                        unsigned long ulFlags = 0) :
+        m_Pool(ulUnitNum, sizeof(T), ulMaxUnitNum, ulFlags) {}
+
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        void* p = m_Pool.Alloc(sizeof(T));
+        if(NULL == p)
+        {
+            throw bad_alloc();
+        }
+        try
+        {
+            return new (p) T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            m_Pool.Free(p);
+            throw;
+        }
+    }
+
+    void destroy(T* p)
+    {
+        if(NULL != p)
+        {
+            p->~T();
+            m_Pool.Free(p);
+        }
+    }
+
+    template <typename... Args>
+    Ptr make(Args&&... args)
+    {
+        return Ptr(construct(std::forward<Args>(args)...), Deleter(this));
+    }
+
+    bool owns(const T* p) const { return m_Pool.Contains(p); }
+    CMemPool& pool() { return m_Pool; }
+private:
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+    CMemPool m_Pool;
+};
+
+#endif //__OBJECTPOOL_H__
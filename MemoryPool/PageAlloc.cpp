@@ -0,0 +1,143 @@
+#include "PageAlloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const unsigned long DEFAULT_HUGE_PAGE_SIZE = 2UL << 20;
+
+static unsigned long ReadHugePageSize()
+{
+    unsigned long ulSize = DEFAULT_HUGE_PAGE_SIZE;
+    FILE *pFile = fopen("/proc/meminfo", "r");
+    if(NULL != pFile)
+    {
+        char szLine[128];
+        unsigned long ulKb;
+        while(NULL != fgets(szLine, sizeof(szLine), pFile))
+        {
+            if(1 == sscanf(szLine, "Hugepagesize: %lu kB", &ulKb))
+            {
+                ulSize = ulKb << 10;
+                break;
+            }
+        }
+        fclose(pFile);
+    }
+    return ulSize;
+}
+
+unsigned long HugePageSize()
+{
+    static const unsigned long s_ulSize = ReadHugePageSize();
+    return s_ulSize;
+}
+
+static unsigned long RoundUp(unsigned long ulBytes, unsigned long ulPage)
+{
+    return (ulBytes + ulPage - 1) / ulPage * ulPage;
+}
+
+//Writes to one byte per page, so that the kernel backs all of them now.
+static void Touch(void* p, unsigned long ulLength)
+{
+    unsigned long ulPage = sysconf(_SC_PAGESIZE);
+    for(unsigned long i=0; i<ulLength; i+=ulPage)
+    {
+        ((volatile char *)p)[i] = 0;
+    }
+}
+
+//A huge-page aligned mapping, so transparent huge pages can back all of it:
+//map one huge page more than needed and cut off both ends.
+static void* MapAligned(unsigned long ulLength, unsigned long ulAlign)
+{
+    void *p = mmap(NULL, ulLength + ulAlign, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == p)
+    {
+        return NULL;
+    }
+    uintptr_t ulStart = ((uintptr_t)p + ulAlign - 1) & ~(uintptr_t)(ulAlign - 1);
+    unsigned long ulHead = ulStart - (uintptr_t)p;
+    if(0 != ulHead)
+    {
+        munmap(p, ulHead);
+    }
+    munmap((char *)ulStart + ulLength, ulAlign - ulHead);
+    return (void *)ulStart;
+}
+
+void* AllocPages(unsigned long ulBytes, unsigned long ulFlags, int& iBacking, unsigned long& ulLength)
+{
+    bool bPrefault = 0 != (ulFlags & MEMPOOL_PREFAULT);
+
+    if(0 == (ulFlags & (MEMPOOL_MMAP | MEMPOOL_HUGE_PAGES)))
+    {
+        void *p = malloc(ulBytes);
+        if(NULL != p && bPrefault)
+        {
+            Touch(p, ulBytes);
+        }
+        iBacking = BACKING_MALLOC;
+        ulLength = ulBytes;
+        return p;
+    }
+
+    int iPopulate = bPrefault ? MAP_POPULATE : 0;
+    if(0 != (ulFlags & MEMPOOL_HUGE_PAGES))
+    {
+        unsigned long ulHuge = HugePageSize();
+        ulLength = RoundUp(ulBytes, ulHuge);
+
+        //Reserved huge pages: fails unless enough are configured.
+        void *p = mmap(NULL, ulLength, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | iPopulate, -1, 0);
+        if(MAP_FAILED != p)
+        {
+            iBacking = BACKING_HUGETLB;
+            return p;
+        }
+
+        //Transparent huge pages. Fault in only after the madvise, or the
+        //pages would already be small ones.
+        p = MapAligned(ulLength, ulHuge);
+        if(NULL != p)
+        {
+            iBacking = (0 == madvise(p, ulLength, MADV_HUGEPAGE)) ? BACKING_THP : BACKING_PAGES;
+            if(bPrefault)
+            {
+                Touch(p, ulLength);
+            }
+            return p;
+        }
+    }
+
+    ulLength = RoundUp(ulBytes, sysconf(_SC_PAGESIZE));
+    void *p = mmap(NULL, ulLength, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | iPopulate, -1, 0);
+    if(MAP_FAILED == p)
+    {
+        return NULL;
+    }
+    iBacking = BACKING_PAGES;
+    return p;
+}
+
+void FreePages(void* p, unsigned long ulLength, int iBacking)
+{
+    if(NULL == p)
+    {
+        return;
+    }
+    if(BACKING_MALLOC == iBacking)
+    {
+        free(p);
+    }
+    else if(BACKING_CALLER != iBacking)
+    {
+        munmap(p, ulLength);
+    }
+}
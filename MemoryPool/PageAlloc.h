@@ -0,0 +1,34 @@
+#ifndef __PAGEALLOC_H__
+#define __PAGEALLOC_H__
+
+//Backing store flags for CMemPool and AllocPages.
+const unsigned long MEMPOOL_MMAP       = 1; //Anonymous mmap instead of malloc.
+const unsigned long MEMPOOL_HUGE_PAGES = 2; //Huge pages if at all possible (implies MEMPOOL_MMAP).
+const unsigned long MEMPOOL_PREFAULT   = 4; //Fault every page in up front.
+
+//What a block actually ended up on.
+enum PageBacking
+{
+    BACKING_CALLER,       //Memory the caller provided.
+    BACKING_MALLOC,
+    BACKING_PAGES,        //mmap, regular pages.
+    BACKING_THP,          //mmap with madvise(MADV_HUGEPAGE): transparent huge pages.
+    BACKING_HUGETLB       //mmap with MAP_HUGETLB: reserved huge pages.
+};
+
+/*==========================================================
+AllocPages:
+    Allocates at least ulBytes the way ulFlags asks for, falling back step
+    by step when that is not available: MAP_HUGETLB needs huge pages
+    reserved in /proc/sys/vm/nr_hugepages, madvise(MADV_HUGEPAGE) needs
+    transparent huge pages enabled, and what is left is regular pages.
+    iBacking tells which one it got and ulLength how much was allocated,
+    both needed by FreePages. Returns NULL if even that fails.
+//=========================================================
+*/
+void* AllocPages(unsigned long ulBytes, unsigned long ulFlags, int& iBacking, unsigned long& ulLength);
+void FreePages(void* p, unsigned long ulLength, int iBacking);
+
+unsigned long HugePageSize(); //The system's default, from /proc/meminfo.
+
+#endif //__PAGEALLOC_H__
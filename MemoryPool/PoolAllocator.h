@@ -0,0 +1,72 @@
+#ifndef __POOLALLOCATOR_H__
+#define __POOLALLOCATOR_H__
+
+#include <stddef.h>
+
+#include <new>
+
+#include "SizeClassAlloc.h"
+
+/*==========================================================
+PoolAllocator<T>:
+    Standard allocator on top of a CSizeClassAlloc, for node-based
+    containers, e.g.
+
+        std::map<int, string, less<int>,
+                 PoolAllocator<pair<const int, string> > > m;
+
+    A container rebinds the allocator to its node type, whose size only it
+    knows, so the allocator does not own a pool of one size: every node size
+    lands in its size class, and bucket arrays and other large blocks take
+    the allocator's malloc path. Without an explicit CSizeClassAlloc all
+    PoolAllocators share DefaultSizeClassAlloc(). Two PoolAllocators are
+    equal, and free each other's memory, when they share the CSizeClassAlloc.
+//=========================================================
+*/
+template <typename T>
+class PoolAllocator
+{
+public:
+    static_assert(alignof(T) <= 16, "size classes are only 16-byte aligned");
+
+    typedef T value_type;
+
+    PoolAllocator() noexcept : m_pAlloc(&DefaultSizeClassAlloc()) {}
+    explicit PoolAllocator(CSizeClassAlloc& alloc) noexcept : m_pAlloc(&alloc) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept : m_pAlloc(other.size_class_alloc()) {}
+
+    T* allocate(size_t n)
+    {
+        if(n > (size_t)-1 / sizeof(T))
+        {
+            throw bad_array_new_length();
+        }
+        void* p = m_pAlloc->Alloc(n * sizeof(T));
+        if(NULL == p)
+        {
+            throw bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) noexcept { m_pAlloc->Free(p); }
+
+    CSizeClassAlloc* size_class_alloc() const noexcept { return m_pAlloc; }
+private:
+    CSizeClassAlloc* m_pAlloc;
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) noexcept
+{
+    return a.size_class_alloc() == b.size_class_alloc();
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif //__POOLALLOCATOR_H__
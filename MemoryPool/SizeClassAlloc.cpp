@@ -0,0 +1,187 @@
+#include "SizeClassAlloc.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/*==========================================================
+CSizeClassAlloc:
+    Constructor of this class. It reserves the address space for all slabs
+    and creates the class pools, each on a slab of its own. Nothing is
+    committed until it is used.
+
+Parameters:
+    [in]ulSlabSize
+    The address space a class gets at a time.
+
+    [in]ulFlags
+    MEMPOOL_DEBUG to record allocation sites in every class, or 0.
+
+    [in]ulSlabCount
+    The slabs to reserve, for the first slab of every class and for classes
+    that run out later.
+//=========================================================
+*/
+CSizeClassAlloc::CSizeClassAlloc(unsigned long ulSlabSize, unsigned long ulFlags, unsigned long ulSlabCount) :
+    m_pReserved(NULL), m_ulReservedSize(0), m_ulSlabShift(12), m_ulLargeAllocs(0), m_ulLargeFrees(0)
+{
+    while((1UL << m_ulSlabShift) < ulSlabSize)
+    {
+        m_ulSlabShift++;
+    }
+    m_ulSlabCount = ulSlabCount < SIZE_CLASS_COUNT ? SIZE_CLASS_COUNT : ulSlabCount;
+    m_ulReservedSize = m_ulSlabCount << m_ulSlabShift;
+
+    //MAP_NORESERVE: do not count the whole range against overcommit limits.
+    void* pReserved = mmap(NULL, m_ulReservedSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(MAP_FAILED != pReserved)
+    {
+        m_pReserved = (char *)pReserved;
+    }
+    else
+    {
+        m_ulReservedSize = 0;
+    }
+
+    m_pSlabPools = new CMemPool*[m_ulSlabCount]();
+    pthread_mutex_init(&m_SlabLock, NULL);
+    m_ulNextSlab = SIZE_CLASS_COUNT;
+    for(unsigned long i=0; i<SIZE_CLASS_COUNT; i++)
+    {
+        m_pClasses[i] = new CMemPool(NULL == m_pReserved ? NULL : m_pReserved + (i << m_ulSlabShift),
+                                     1UL << m_ulSlabShift, ClassSize(i), ulFlags,
+                                     NULL == m_pReserved ? NULL : this);
+        m_pSlabPools[i] = m_pClasses[i];
+    }
+}
+
+/*===============================================================
+~CSizeClassAlloc():
+    Destructor of this class. Everything still allocated from a class
+    becomes invalid; memory from malloc stays the caller's to free.
+//===============================================================
+*/
+CSizeClassAlloc::~CSizeClassAlloc()
+{
+    for(unsigned long i=0; i<SIZE_CLASS_COUNT; i++)
+    {
+        delete m_pClasses[i];
+    }
+    delete[] m_pSlabPools;
+    pthread_mutex_destroy(&m_SlabLock);
+    if(NULL != m_pReserved)
+    {
+        munmap(m_pReserved, m_ulReservedSize);
+    }
+}
+
+/*================================================================
+GetBlock:
+    Called by a class pool that has used up its slabs: hands it the next
+    free slab, or NULL once all are taken. The slab is entered in the table
+    before the pool carves a unit from it, so Free can always find it.
+//================================================================
+*/
+void* CSizeClassAlloc::GetBlock(CMemPool* pPool, unsigned long& ulBlockSize)
+{
+    void* pBlock = NULL;
+    pthread_mutex_lock(&m_SlabLock);
+    if(m_ulNextSlab < m_ulSlabCount)
+    {
+        m_pSlabPools[m_ulNextSlab] = pPool;
+        pBlock = m_pReserved + (m_ulNextSlab << m_ulSlabShift);
+        ulBlockSize = 1UL << m_ulSlabShift;
+        m_ulNextSlab++;
+    }
+    pthread_mutex_unlock(&m_SlabLock);
+    return pBlock;
+}
+
+/*================================================================
+Alloc:
+    To allocate ulSize bytes from the smallest class that fits, or from
+    malloc if none does.
+//================================================================
+*/
+void* CSizeClassAlloc::Alloc(unsigned long ulSize)
+{
+    if(ulSize > MAX_SMALL_SIZE)
+    {
+        m_ulLargeAllocs.fetch_add(1, memory_order_relaxed);
+        return malloc(ulSize);
+    }
+    return m_pClasses[SizeClassOf(ulSize)]->Alloc(ulSize);
+}
+
+/*================================================================
+Free:
+    To free memory from Alloc. The class is found from the slab the address
+    lies in.
+//================================================================
+*/
+void CSizeClassAlloc::Free(void* p)
+{
+    //Wraps around for addresses below the range, so one compare does.
+    unsigned long ulOffset = (unsigned long)((uintptr_t)p - (uintptr_t)m_pReserved);
+    if(ulOffset < m_ulReservedSize)
+    {
+        m_pSlabPools[ulOffset >> m_ulSlabShift]->Free(p);
+    }
+    else if(NULL != p)
+    {
+        m_ulLargeFrees.fetch_add(1, memory_order_relaxed);
+        free(p);
+    }
+}
+
+MemPoolStats CSizeClassAlloc::GetStats(unsigned long ulClass) const
+{
+    return m_pClasses[ulClass]->GetStats();
+}
+
+unsigned long CSizeClassAlloc::ReportLeaks(FILE* pFile) const
+{
+    unsigned long ulLive = 0;
+    for(unsigned long i=0; i<SIZE_CLASS_COUNT; i++)
+    {
+        ulLive += m_pClasses[i]->ReportLeaks(pFile);
+    }
+    return ulLive;
+}
+
+/*================================================================
+Dump:
+    Writes the large allocation counters and CMemPool::Dump of every class
+    that has been used to szPath as one JSON object.
+//================================================================
+*/
+int CSizeClassAlloc::Dump(const char* szPath) const
+{
+    FILE *pFile = fopen(szPath, "w");
+    if(NULL == pFile)
+    {
+        return -1;
+    }
+    fprintf(pFile, "{\"large_allocs\":%lu,\"large_frees\":%lu,\n\"classes\":[",
+            m_ulLargeAllocs.load(memory_order_relaxed), m_ulLargeFrees.load(memory_order_relaxed));
+    bool bFirst = true;
+    for(unsigned long i=0; i<SIZE_CLASS_COUNT; i++)
+    {
+        MemPoolStats Stats = m_pClasses[i]->GetStats();
+        if(0 == Stats.ulAllocs + Stats.ulMallocAllocs)
+        {
+            continue;
+        }
+        fprintf(pFile, "%s\n", bFirst ? "" : ",");
+        m_pClasses[i]->Dump(pFile);
+        bFirst = false;
+    }
+    fprintf(pFile, "]}\n");
+    return 0 == fclose(pFile) ? 0 : -1;
+}
+
+CSizeClassAlloc& DefaultSizeClassAlloc()
+{
+    static CSizeClassAlloc* s_pAlloc = new CSizeClassAlloc;
+    return *s_pAlloc;
+}
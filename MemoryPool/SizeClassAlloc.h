@@ -0,0 +1,100 @@
+#ifndef __SIZECLASSALLOC_H__
+#define __SIZECLASSALLOC_H__
+
+#include "MemPool.h"
+
+//Multiples of 16 up to 128 bytes, then four classes per power of two.
+const unsigned long SIZE_CLASS_COUNT = 40;
+const unsigned long MAX_SMALL_SIZE = 32768;   //Largest class; bigger requests go to malloc.
+const unsigned long DEFAULT_SLAB_SIZE = 64UL << 20;
+const unsigned long DEFAULT_SLAB_COUNT = 256;  //16 GiB of address space with the default slab size.
+
+/*==========================================================
+CSizeClassAlloc:
+    A general-purpose allocator for small objects, built from one CMemPool
+    per size class. A request is rounded up to the next class: 16, 32, ...
+    128, then 160, 192, 224, 256, 320, ... 32768, so above 128 bytes no
+    more than a quarter of a unit is wasted.
+
+    At construction the allocator reserves one range of address space and
+    cuts it into equal, power-of-two sized slabs. Every class starts with a
+    slab of its own and carves its units from it a batch at a time as they
+    are needed, so the reservation costs address space, not memory. A class
+    that has used up its slab chains the next free slab of the reservation,
+    so a workload heavy in one class can take most of it. Free finds the
+    slab from the address alone and the class from a table of slabs, in
+    O(1) and without a header in front of the object.
+
+    Requests above MAX_SMALL_SIZE go straight to malloc. Once every slab is
+    taken, a class that runs out of units falls back to malloc as well
+    (GetStats counts those as ulMallocAllocs); a larger ulSlabCount or
+    ulSlabSize avoids that. Free tells malloc memory apart by its address.
+
+    GetStats(ulClass) gives one class's occupancy and counters; Dump() and
+    ReportLeaks() cover every class that has been used.
+//=========================================================
+*/
+class CSizeClassAlloc : private CMemPoolBlockSource
+{
+public:
+    //ulSlabSize: rounded up to a power of two.
+    //ulFlags: MEMPOOL_DEBUG for every class
+    //ulSlabCount: slabs reserved for all classes together, at least one per class.
+    CSizeClassAlloc(unsigned long ulSlabSize = DEFAULT_SLAB_SIZE, unsigned long ulFlags = 0,
+                    unsigned long ulSlabCount = DEFAULT_SLAB_COUNT);
+    ~CSizeClassAlloc();
+
+    void* Alloc(unsigned long ulSize);
+    void Free(void* p);
+
+    static unsigned long SizeClassOf(unsigned long ulSize); //ulSize <= MAX_SMALL_SIZE
+    static unsigned long ClassSize(unsigned long ulClass);
+
+    MemPoolStats GetStats(unsigned long ulClass) const;
+    unsigned long ReportLeaks(FILE* pFile = stderr) const; //Live units in all classes.
+    int Dump(const char* szPath) const;                    //-1 if it cannot be written.
+
+private:
+    CSizeClassAlloc(const CSizeClassAlloc&);
+    CSizeClassAlloc& operator=(const CSizeClassAlloc&);
+
+    void* GetBlock(CMemPool* pPool, unsigned long& ulBlockSize);
+
+    char*            m_pReserved;      //NULL if the reservation failed; then all goes to malloc.
+    unsigned long    m_ulReservedSize;
+    unsigned long    m_ulSlabShift;    //log2 of the slab size.
+    unsigned long    m_ulSlabCount;
+    CMemPool*        m_pClasses[SIZE_CLASS_COUNT];
+    CMemPool**       m_pSlabPools;     //The class pool of every slab handed out so far.
+    pthread_mutex_t  m_SlabLock;       //Guards m_ulNextSlab and new entries of m_pSlabPools.
+    unsigned long    m_ulNextSlab;     //First slab no class has taken yet.
+    atomic<unsigned long> m_ulLargeAllocs;  //Above MAX_SMALL_SIZE.
+    atomic<unsigned long> m_ulLargeFrees;   //Of those, and of class fallbacks to malloc.
+};
+
+//One allocator for the whole process, created on first use and never
+//destroyed, so it is safe to use from static destructors too.
+CSizeClassAlloc& DefaultSizeClassAlloc();
+
+inline unsigned long CSizeClassAlloc::SizeClassOf(unsigned long ulSize)
+{
+    if(ulSize <= 128)
+    {
+        return 0 == ulSize ? 0 : (ulSize - 1) >> 4;
+    }
+    //ulSize is in (2^ulLog, 2^(ulLog+1)], which is split in four classes.
+    unsigned long ulLog = 63 - __builtin_clzl(ulSize - 1);
+    return 8 + (ulLog - 7) * 4 + ((ulSize - 1 - (1UL << ulLog)) >> (ulLog - 2));
+}
+
+inline unsigned long CSizeClassAlloc::ClassSize(unsigned long ulClass)
+{
+    if(ulClass < 8)
+    {
+        return (ulClass + 1) * 16;
+    }
+    unsigned long ulLog = 7 + (ulClass - 8) / 4;
+    return (1UL << ulLog) + ((ulClass - 8) % 4 + 1) * (1UL << (ulLog - 2));
+}
+
+#endif //__SIZECLASSALLOC_H__
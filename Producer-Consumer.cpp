@@ -1,85 +1,74 @@
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include </usr/include/semaphore.h>
+
+#include "ProducerConsumer/RingBuffer.h"
  
 // for sleep
 #include <unistd.h>
  
-#define BUFF_SIZE   5           /* total number of slots */
+#define BUFF_SIZE   8           /* total number of slots, a power of two */
 #define NP          3           /* total number of producers */
 #define NC          3           /* total number of consumers */
 #define NITERS      4           /* number of items produced/consumed */
+#define BATCH       2           /* items moved per push_n/pop_n */
  
-typedef struct
-{
-    int buf[BUFF_SIZE];   /* shared var */
-    int in;               /* buf[in%BUFF_SIZE] is the first empty slot */
-    int out;              /* buf[out%BUFF_SIZE] is the first full slot */
-    sem_t full;           /* keep track of the number of full spots */
-    sem_t empty;          /* keep track of the number of empty spots */
- 
-    // use correct type here
-    pthread_mutex_t mutex;          /* enforce mutual exclusion to shared data */
-} sbuf_t;
+/* Lock-free ring of BUFF_SIZE ints. push_n() waits while it is full and
+   pop_n() while it is empty, spinning briefly and then sleeping on a futex,
+   which replaces the two counting semaphores and the mutex around the
+   buffer. Each call moves a whole batch with one update of the ring's
+   position. */
+typedef BlockingRingBuffer<int, BUFF_SIZE, MPMC> sbuf_t;
  
 sbuf_t shared;
  
  
 void *Producer(void *arg)
 {
-    int i, item, index;
+    int i, n, k, items[BATCH], index;
  
-    index = (int)arg;
+    index = (int)(intptr_t)arg;
  
  
-    for (i=0; i < NITERS; i++)
+    for (i=0; i < NITERS; i += n)
     {
  
-        /* Produce item */
-        item = i;
+        /* Produce a batch of items */
+        for (n=0; n < BATCH && i+n < NITERS; n++)
+            items[n] = i+n;
  
-        /* Prepare to write item to buf */
- 
-        /* If there are no empty slots, wait */
-        sem_wait(&shared.empty);
-        /* If another thread uses the buffer, wait */
-        pthread_mutex_lock(&shared.mutex);
-        shared.buf[shared.in] = item;
-        shared.in = (shared.in+1)%BUFF_SIZE;
-        printf("[P%d] Producing %d ...\n", index, item);
+        /* Print before publishing, so no consumer can report an item
+           before its producer has */
+        for (k=0; k < n; k++)
+            printf("[P%d] Producing %d ...\n", index, items[k]);
         fflush(stdout);
-        /* Release the buffer */
-        pthread_mutex_unlock(&shared.mutex);
-        /* Increment the number of full slots */
-        sem_post(&shared.full);
  
-        /* Interleave  producer and consumer execution */
-        if (i % 2 == 1) sleep(1);
+        /* Write them to buf; wait while there are no empty slots */
+        shared.push_n(items, n);
+ 
+        /* Interleave  producer and consumer execution: sleep after every
+           second item, however the items were batched */
+        if ((i+n)/2 != i/2) sleep(1);
     }
     return NULL;
 }
  
 void *Consumer(void *arg)
 {
-    int i, item, index;
- 
-    index = (int)arg;
-    for (i=NITERS; i > 0; i--) {
-        sem_wait(&shared.full);
-        pthread_mutex_lock(&shared.mutex);
-        item=i;
-        item=shared.buf[shared.out];
-        shared.out = (shared.out+1)%BUFF_SIZE;
-        printf("[C%d] Consuming  %d ...\n", index, item);
+    int i, n, k, items[BATCH], index;
+ 
+    index = (int)(intptr_t)arg;
+    for (i=NITERS; i > 0; i -= n) {
+        /* Take up to a batch of full slots; wait while there are none */
+        n = (int)shared.pop_n(items, i < BATCH ? i : BATCH);
+        for (k=0; k < n; k++)
+            printf("[C%d] Consuming  %d ...\n", index, items[k]);
         fflush(stdout);
-        /* Release the buffer */
-        pthread_mutex_unlock(&shared.mutex);
-        /* Increment the number of full slots */
-        sem_post(&shared.empty);
  
-        /* Interleave  producer and consumer execution */
-        if (i % 2 == 1) sleep(1);
+        /* Interleave  producer and consumer execution: sleep after every
+           second item, however the items were batched */
+        if ((NITERS-i+n)/2 != (NITERS-i)/2) sleep(1);
     }
     return NULL;
 }
@@ -89,18 +78,15 @@ int main()
     pthread_t idP, idC;
     int index;
  
-    sem_init(&shared.full, 0, 0);
-    sem_init(&shared.empty, 0, BUFF_SIZE);
-    pthread_mutex_init(&shared.mutex, NULL);
     for (index = 0; index < NP; index++)
     {
         /* Create a new producer */
-        pthread_create(&idP, NULL, Producer, (void*)index);
+        pthread_create(&idP, NULL, Producer, (void*)(intptr_t)index);
     }
     /*create a new Consumer*/
     for(index=0; index<NC; index++)
     {
-        pthread_create(&idC, NULL, Consumer, (void*)index);
+        pthread_create(&idC, NULL, Consumer, (void*)(intptr_t)index);
     }
  
  
@@ -0,0 +1,729 @@
+#ifndef _H_RINGBUFFER
+#define _H_RINGBUFFER
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iterator>
+#include <utility>
+
+#include "../ThreadPool/Platform.h"
+
+using namespace std;
+
+// Fixed-size rings for handing values from one pipeline stage to the next.
+//
+//   RingBuffer<T, N, SPSC>   one producer thread and one consumer thread;
+//                            wait-free, a push or pop is one release store
+//   RingBuffer<T, N, MPMC>   any number of producers and consumers;
+//                            lock-free, with a sequence number per slot as
+//                            in MPMCQueue
+//   BlockingRing<Ring>       push() and pop() that wait for room or for a
+//                            value: they spin for a while, then sleep on a
+//                            futex until the other side makes progress
+//
+// N must be a power of two, so a position is masked instead of taken modulo
+// N. Positions only ever grow (64 bits do not wrap in practice), so full and
+// empty are told apart without a spare slot. Producers and consumers each
+// keep their position on a cache line of their own. The slots are part of
+// the object, so a large ring belongs in static storage or on the heap.
+// Values are stored by value and moved in and out, so T has to be default
+// constructible and movable.
+//
+// Besides one value at a time, both rings move values in batches:
+//   try_push_n / try_pop_n  as many values as fit (or are there), up to a
+//                           count, claimed with a single position update
+//   reserve / commit        a run of free slots the producer fills in place
+//   peek / release          a run of full slots the consumer reads in place
+// A reserved or peeked run is contiguous in memory, so it ends at the end
+// of the slot array even if the ring goes on at its start; ask again for
+// the rest. In an MPMC ring reserve and peek claim their slots at once and
+// the consumers (producers) of the positions after them wait until they
+// are committed (released), so fill or read them and hand them on quickly.
+
+// Ring modes
+struct SPSC {};
+struct MPMC {};
+
+// count slots at data, starting at ring position pos. count is 0 when
+// nothing could be reserved or peeked.
+template <typename T>
+struct RingSlice
+{
+  T* data;
+  size_t count;
+  size_t pos;
+};
+
+template <typename T, size_t N, typename Mode = MPMC>
+class RingBuffer;
+
+template <typename T, size_t N>
+class RingBuffer<T, N, SPSC>
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "RingBuffer capacity must be a power of two");
+public:
+  typedef T value_type;
+
+  RingBuffer() : m_head(0), m_cached_tail(0), m_tail(0), m_cached_head(0) {}
+
+  // Producer thread only. value is only moved from when the call succeeds.
+  template <typename U>
+  bool try_push(U&& value);
+  template <typename Iter>
+  size_t try_push_n(Iter first, size_t count);
+  RingSlice<T> reserve(size_t max);
+  void commit(const RingSlice<T>& slice);
+
+  // Consumer thread only
+  bool try_pop(T& value);
+  template <typename OutIter>
+  size_t try_pop_n(OutIter out, size_t max);
+  RingSlice<T> peek(size_t max);
+  void release(const RingSlice<T>& slice);
+
+  // Snapshots, the other side may change the ring right after they return
+  bool empty() const { return size() == 0; }
+  size_t size() const;
+  static constexpr size_t capacity() { return N; }
+private:
+  RingBuffer(const RingBuffer&);
+  RingBuffer& operator=(const RingBuffer&);
+
+  static const size_t MASK = N - 1;
+
+  size_t room(size_t tail, size_t wanted);
+  size_t filled(size_t head, size_t wanted);
+
+  // The consumer's line: the next position to read, and the producer's
+  // position as last seen, so the consumer only reads m_tail when it seems
+  // to have caught up.
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_head;
+  size_t m_cached_tail;
+  // The producer's line, the same the other way round
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_tail;
+  size_t m_cached_head;
+  alignas(CACHE_LINE_SIZE) T m_slots[N];
+};
+
+template <typename T, size_t N>
+template <typename U>
+bool RingBuffer<T, N, SPSC>::try_push(U&& value)
+{
+  size_t tail = m_tail.load(memory_order_relaxed);
+  if (tail - m_cached_head == N) {
+    m_cached_head = m_head.load(memory_order_acquire);
+    if (tail - m_cached_head == N) {
+      return false; // full
+    }
+  }
+  m_slots[tail & MASK] = std::forward<U>(value);
+  m_tail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+template <typename T, size_t N>
+bool RingBuffer<T, N, SPSC>::try_pop(T& value)
+{
+  size_t head = m_head.load(memory_order_relaxed);
+  if (head == m_cached_tail) {
+    m_cached_tail = m_tail.load(memory_order_acquire);
+    if (head == m_cached_tail) {
+      return false; // empty
+    }
+  }
+  value = std::move(m_slots[head & MASK]);
+  m_head.store(head + 1, memory_order_release);
+  return true;
+}
+
+// Free slots from tail on, up to wanted; reads m_head only if the last
+// value seen leaves fewer than that
+template <typename T, size_t N>
+size_t RingBuffer<T, N, SPSC>::room(size_t tail, size_t wanted)
+{
+  if (N - (tail - m_cached_head) < wanted) {
+    m_cached_head = m_head.load(memory_order_acquire);
+  }
+  size_t free = N - (tail - m_cached_head);
+  return free < wanted ? free : wanted;
+}
+
+template <typename T, size_t N>
+size_t RingBuffer<T, N, SPSC>::filled(size_t head, size_t wanted)
+{
+  if (m_cached_tail - head < wanted) {
+    m_cached_tail = m_tail.load(memory_order_acquire);
+  }
+  size_t full = m_cached_tail - head;
+  return full < wanted ? full : wanted;
+}
+
+// Moves up to count values from first into the ring and returns how many
+// made it in. They become visible to the consumer all at once.
+template <typename T, size_t N>
+template <typename Iter>
+size_t RingBuffer<T, N, SPSC>::try_push_n(Iter first, size_t count)
+{
+  size_t tail = m_tail.load(memory_order_relaxed);
+  size_t n = room(tail, count);
+  for (size_t i = 0; i < n; i++, ++first) {
+    m_slots[(tail + i) & MASK] = std::move(*first);
+  }
+  if (n > 0) {
+    m_tail.store(tail + n, memory_order_release);
+  }
+  return n;
+}
+
+// Moves up to max values to out and returns how many there were
+template <typename T, size_t N>
+template <typename OutIter>
+size_t RingBuffer<T, N, SPSC>::try_pop_n(OutIter out, size_t max)
+{
+  size_t head = m_head.load(memory_order_relaxed);
+  size_t n = filled(head, max);
+  for (size_t i = 0; i < n; i++, ++out) {
+    *out = std::move(m_slots[(head + i) & MASK]);
+  }
+  if (n > 0) {
+    m_head.store(head + n, memory_order_release);
+  }
+  return n;
+}
+
+template <typename T, size_t N>
+RingSlice<T> RingBuffer<T, N, SPSC>::reserve(size_t max)
+{
+  size_t tail = m_tail.load(memory_order_relaxed);
+  size_t to_end = N - (tail & MASK);
+  RingSlice<T> slice = { &m_slots[tail & MASK], room(tail, max < to_end ? max : to_end), tail };
+  return slice;
+}
+
+// Publishes every slot of a slice from reserve()
+template <typename T, size_t N>
+void RingBuffer<T, N, SPSC>::commit(const RingSlice<T>& slice)
+{
+  if (slice.count > 0) {
+    m_tail.store(slice.pos + slice.count, memory_order_release);
+  }
+}
+
+template <typename T, size_t N>
+RingSlice<T> RingBuffer<T, N, SPSC>::peek(size_t max)
+{
+  size_t head = m_head.load(memory_order_relaxed);
+  size_t to_end = N - (head & MASK);
+  RingSlice<T> slice = { &m_slots[head & MASK], filled(head, max < to_end ? max : to_end), head };
+  return slice;
+}
+
+// Hands every slot of a slice from peek() back to the producer
+template <typename T, size_t N>
+void RingBuffer<T, N, SPSC>::release(const RingSlice<T>& slice)
+{
+  if (slice.count > 0) {
+    m_head.store(slice.pos + slice.count, memory_order_release);
+  }
+}
+
+template <typename T, size_t N>
+size_t RingBuffer<T, N, SPSC>::size() const
+{
+  // the head first: the tail read after it can only be further ahead
+  size_t head = m_head.load(memory_order_acquire);
+  size_t tail = m_tail.load(memory_order_acquire);
+  return tail - head < N ? tail - head : N;
+}
+
+template <typename T, size_t N>
+class RingBuffer<T, N, MPMC>
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "RingBuffer capacity must be a power of two");
+public:
+  typedef T value_type;
+
+  RingBuffer();
+
+  // value is only moved from when the call succeeds
+  template <typename U>
+  bool try_push(U&& value);
+  template <typename Iter>
+  size_t try_push_n(Iter first, size_t count);
+  RingSlice<T> reserve(size_t max);
+  void commit(const RingSlice<T>& slice);
+
+  bool try_pop(T& value);
+  template <typename OutIter>
+  size_t try_pop_n(OutIter out, size_t max);
+  RingSlice<T> peek(size_t max);
+  void release(const RingSlice<T>& slice);
+
+  // Snapshots, another thread may change the ring right after they return
+  bool empty() const { return size() == 0; }
+  size_t size() const;
+  static constexpr size_t capacity() { return N; }
+private:
+  RingBuffer(const RingBuffer&);
+  RingBuffer& operator=(const RingBuffer&);
+
+  static const size_t MASK = N - 1;
+
+  size_t claim(atomic<size_t>& position, size_t ready, size_t max, bool contiguous, size_t& pos);
+  void publish(size_t pos, size_t count, size_t next);
+
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_head; // next position to pop
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_tail; // next position to push
+  // Per slot, apart from the values so that a run of slots is one array:
+  //   sequence == pos      the slot is free for the producer that claims pos
+  //   sequence == pos + 1  it holds the value for the consumer that claims pos
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_sequences[N];
+  alignas(CACHE_LINE_SIZE) T m_slots[N];
+};
+
+template <typename T, size_t N>
+RingBuffer<T, N, MPMC>::RingBuffer() : m_head(0), m_tail(0)
+{
+  for (size_t i = 0; i < N; i++) {
+    m_sequences[i].store(i, memory_order_relaxed);
+  }
+}
+
+template <typename T, size_t N>
+template <typename U>
+bool RingBuffer<T, N, MPMC>::try_push(U&& value)
+{
+  size_t pos = m_tail.load(memory_order_relaxed);
+  while (true) {
+    size_t seq = m_sequences[pos & MASK].load(memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (m_tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // full: the consumer of the previous lap is not done yet
+    } else {
+      pos = m_tail.load(memory_order_relaxed); // someone beat us to it
+    }
+  }
+  m_slots[pos & MASK] = std::forward<U>(value);
+  m_sequences[pos & MASK].store(pos + 1, memory_order_release);
+  return true;
+}
+
+template <typename T, size_t N>
+bool RingBuffer<T, N, MPMC>::try_pop(T& value)
+{
+  size_t pos = m_head.load(memory_order_relaxed);
+  while (true) {
+    size_t seq = m_sequences[pos & MASK].load(memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (diff == 0) {
+      if (m_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // empty: the producer of this slot is not done yet
+    } else {
+      pos = m_head.load(memory_order_relaxed);
+    }
+  }
+  value = std::move(m_slots[pos & MASK]);
+  // hand the slot over to the producer of the next lap
+  m_sequences[pos & MASK].store(pos + N, memory_order_release);
+  return true;
+}
+
+// Claims the leading run of up to max slots at position (m_tail with ready
+// 0 for producers, m_head with ready 1 for consumers) whose sequence is
+// pos + i + ready, with a single CAS. A slot in that state stays in it
+// until whoever claims its position uses it, so the whole run is ours after
+// the CAS. Returns the run's length, 0 if the ring is full (empty).
+template <typename T, size_t N>
+size_t RingBuffer<T, N, MPMC>::claim(atomic<size_t>& position, size_t ready, size_t max,
+                                     bool contiguous, size_t& pos)
+{
+  pos = position.load(memory_order_relaxed);
+  while (max > 0) {
+    size_t limit = max;
+    if (contiguous && limit > N - (pos & MASK)) {
+      limit = N - (pos & MASK);
+    }
+    size_t claimed = 0;
+    while (claimed < limit &&
+           m_sequences[(pos + claimed) & MASK].load(memory_order_acquire) == pos + claimed + ready) {
+      claimed++;
+    }
+
+    if (claimed == 0) {
+      size_t seq = m_sequences[pos & MASK].load(memory_order_acquire);
+      if ((intptr_t) seq - (intptr_t) (pos + ready) < 0) {
+        return 0;
+      }
+      pos = position.load(memory_order_relaxed); // someone beat us to it
+      continue;
+    }
+    if (position.compare_exchange_weak(pos, pos + claimed, memory_order_relaxed)) {
+      return claimed;
+    }
+  }
+  return 0;
+}
+
+// Hands count slots from pos on to the other side: next is 1 after a push,
+// N after a pop
+template <typename T, size_t N>
+void RingBuffer<T, N, MPMC>::publish(size_t pos, size_t count, size_t next)
+{
+  for (size_t i = 0; i < count; i++) {
+    m_sequences[(pos + i) & MASK].store(pos + i + next, memory_order_release);
+  }
+}
+
+// Moves up to count values from first into the ring with a single CAS on
+// m_tail and returns how many made it in
+template <typename T, size_t N>
+template <typename Iter>
+size_t RingBuffer<T, N, MPMC>::try_push_n(Iter first, size_t count)
+{
+  size_t pos;
+  size_t n = claim(m_tail, 0, count, false, pos);
+  for (size_t i = 0; i < n; i++, ++first) {
+    m_slots[(pos + i) & MASK] = std::move(*first);
+  }
+  publish(pos, n, 1);
+  return n;
+}
+
+// Moves up to max values to out with a single CAS on m_head and returns how
+// many there were
+template <typename T, size_t N>
+template <typename OutIter>
+size_t RingBuffer<T, N, MPMC>::try_pop_n(OutIter out, size_t max)
+{
+  size_t pos;
+  size_t n = claim(m_head, 1, max, false, pos);
+  for (size_t i = 0; i < n; i++, ++out) {
+    *out = std::move(m_slots[(pos + i) & MASK]);
+  }
+  publish(pos, n, N);
+  return n;
+}
+
+template <typename T, size_t N>
+RingSlice<T> RingBuffer<T, N, MPMC>::reserve(size_t max)
+{
+  RingSlice<T> slice;
+  slice.count = claim(m_tail, 0, max, true, slice.pos);
+  slice.data = &m_slots[slice.pos & MASK];
+  return slice;
+}
+
+// Publishes every slot of a slice from reserve()
+template <typename T, size_t N>
+void RingBuffer<T, N, MPMC>::commit(const RingSlice<T>& slice)
+{
+  publish(slice.pos, slice.count, 1);
+}
+
+template <typename T, size_t N>
+RingSlice<T> RingBuffer<T, N, MPMC>::peek(size_t max)
+{
+  RingSlice<T> slice;
+  slice.count = claim(m_head, 1, max, true, slice.pos);
+  slice.data = &m_slots[slice.pos & MASK];
+  return slice;
+}
+
+// Hands every slot of a slice from peek() back to the producers
+template <typename T, size_t N>
+void RingBuffer<T, N, MPMC>::release(const RingSlice<T>& slice)
+{
+  publish(slice.pos, slice.count, N);
+}
+
+template <typename T, size_t N>
+size_t RingBuffer<T, N, MPMC>::size() const
+{
+  size_t head = m_head.load(memory_order_seq_cst);
+  size_t tail = m_tail.load(memory_order_seq_cst);
+  return tail > head ? (tail - head < N ? tail - head : N) : 0;
+}
+
+// Sleeping and waking on a 32-bit word, private to this process
+inline void futex_wait(atomic<uint32_t>* word, uint32_t expected)
+{
+  static_assert(sizeof(atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+  syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+inline void futex_wake(atomic<uint32_t>* word, int count)
+{
+  syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Bounds for the spin phase of BlockingRing, in failed attempts
+const int RING_MIN_SPINS = 16;
+const int RING_MAX_SPINS = 2000;
+
+// Blocking push() and pop() over one of the rings above.
+//
+// A push or pop first retries for a while, then sleeps on a futex. How long
+// it retries adapts the way glibc's adaptive mutexes do: a running average
+// of how many attempts it took the last times waiting paid off, so a
+// pipeline whose stages keep pace spins briefly and one that stalls for
+// long sleeps almost at once. With a single CPU there is nothing to wait
+// for while spinning, so it sleeps right away.
+//
+// Each side counts its operations in a futex word (m_pushes, m_pops) and
+// sleepers register in m_pop_waiters or m_push_waiters first. The other side
+// bumps the word and wakes sleepers only when somebody is registered, so
+// when nobody sleeps a push or pop costs the ring's own work plus one
+// fence, no system call. A batch wakes as many sleepers as it moved values.
+//
+// push_n() waits until all values are in, pop_n() until there is at least
+// one. reserve() and peek() do not wait; commit() and release() wake the
+// other side.
+template <typename Ring>
+class BlockingRing
+{
+public:
+  typedef typename Ring::value_type value_type;
+
+  BlockingRing();
+
+  template <typename U>
+  void push(U&& value);
+  void pop(value_type& value);
+  template <typename Iter>
+  void push_n(Iter first, size_t count);
+  template <typename OutIter>
+  size_t pop_n(OutIter out, size_t max);
+
+  // Do not wait, but wake a sleeper on the other side as push() and pop() do
+  template <typename U>
+  bool try_push(U&& value);
+  bool try_pop(value_type& value);
+  template <typename Iter>
+  size_t try_push_n(Iter first, size_t count);
+  template <typename OutIter>
+  size_t try_pop_n(OutIter out, size_t max);
+
+  RingSlice<value_type> reserve(size_t max) { return m_ring.reserve(max); }
+  void commit(const RingSlice<value_type>& slice);
+  RingSlice<value_type> peek(size_t max) { return m_ring.peek(max); }
+  void release(const RingSlice<value_type>& slice);
+
+  bool empty() const { return m_ring.empty(); }
+  size_t size() const { return m_ring.size(); }
+  static constexpr size_t capacity() { return Ring::capacity(); }
+private:
+  BlockingRing(const BlockingRing&);
+  BlockingRing& operator=(const BlockingRing&);
+
+  static int cpu_count();
+  static void adapt(atomic<int>& spins, int used);
+  static void notify(atomic<uint32_t>& counter, atomic<uint32_t>& waiters, size_t count);
+  template <typename Attempt>
+  static void wait_for(Attempt attempt, atomic<int>& spins, atomic<uint32_t>& counter,
+                       atomic<uint32_t>& waiters);
+
+  Ring m_ring;
+  // consumers sleep on m_pushes, producers on m_pops
+  alignas(CACHE_LINE_SIZE) atomic<uint32_t> m_pushes;
+  atomic<uint32_t> m_pop_waiters;
+  atomic<int> m_pop_spins;
+  alignas(CACHE_LINE_SIZE) atomic<uint32_t> m_pops;
+  atomic<uint32_t> m_push_waiters;
+  atomic<int> m_push_spins;
+};
+
+// A blocking RingBuffer<T, N, Mode>, the drop-in for a semaphore-guarded buffer
+template <typename T, size_t N, typename Mode = MPMC>
+using BlockingRingBuffer = BlockingRing<RingBuffer<T, N, Mode> >;
+
+template <typename Ring>
+BlockingRing<Ring>::BlockingRing()
+    : m_pushes(0), m_pop_waiters(0), m_pop_spins(RING_MIN_SPINS),
+      m_pops(0), m_push_waiters(0), m_push_spins(RING_MIN_SPINS)
+{
+}
+
+template <typename Ring>
+int BlockingRing<Ring>::cpu_count()
+{
+  static const int count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  return count;
+}
+
+// Moves the spin limit an eighth of the way towards twice what was needed,
+// or towards the minimum (used == 0) when it was not enough
+template <typename Ring>
+void BlockingRing<Ring>::adapt(atomic<int>& spins, int used)
+{
+  int current = spins.load(memory_order_relaxed);
+  int next = current + (2 * used - current) / 8;
+  next = next < RING_MIN_SPINS ? RING_MIN_SPINS : (next > RING_MAX_SPINS ? RING_MAX_SPINS : next);
+  spins.store(next, memory_order_relaxed);
+}
+
+// Called after count values were pushed (counter m_pushes) or popped
+// (m_pops). The fence orders the ring update before the waiter check,
+// against the sleeper registering before it looks at the ring: either it
+// sees the update or we see it.
+template <typename Ring>
+void BlockingRing<Ring>::notify(atomic<uint32_t>& counter, atomic<uint32_t>& waiters,
+                                size_t count)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (count > 0 && waiters.load(memory_order_relaxed) != 0) {
+    counter.fetch_add(1, memory_order_release);
+    futex_wake(&counter, count < INT_MAX ? (int) count : INT_MAX);
+  }
+}
+
+// Retries attempt() until it returns true: as long as spinning pays off,
+// then sleeping on counter until the other side bumps it
+template <typename Ring>
+template <typename Attempt>
+void BlockingRing<Ring>::wait_for(Attempt attempt, atomic<int>& spins, atomic<uint32_t>& counter,
+                                  atomic<uint32_t>& waiters)
+{
+  int limit = cpu_count() > 1 ? spins.load(memory_order_relaxed) : 0;
+  for (int i = 0; i < limit; i++) {
+    if (attempt()) {
+      adapt(spins, i);
+      return;
+    }
+    cpu_relax();
+  }
+  if (limit > 0) {
+    adapt(spins, 0); // spinning did not pay off, spin less next time
+  }
+
+  while (true) {
+    waiters.fetch_add(1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst); // pairs with the one in notify()
+    uint32_t seen = counter.load(memory_order_acquire);
+    bool done = attempt();
+    if (!done) {
+      futex_wait(&counter, seen);
+      done = attempt();
+    }
+    waiters.fetch_sub(1, memory_order_relaxed);
+    if (done) {
+      return;
+    }
+  }
+}
+
+template <typename Ring>
+template <typename U>
+bool BlockingRing<Ring>::try_push(U&& value)
+{
+  if (!m_ring.try_push(std::forward<U>(value))) {
+    return false;
+  }
+  notify(m_pushes, m_pop_waiters, 1);
+  return true;
+}
+
+template <typename Ring>
+bool BlockingRing<Ring>::try_pop(value_type& value)
+{
+  if (!m_ring.try_pop(value)) {
+    return false;
+  }
+  notify(m_pops, m_push_waiters, 1);
+  return true;
+}
+
+template <typename Ring>
+template <typename Iter>
+size_t BlockingRing<Ring>::try_push_n(Iter first, size_t count)
+{
+  size_t n = m_ring.try_push_n(first, count);
+  notify(m_pushes, m_pop_waiters, n);
+  return n;
+}
+
+template <typename Ring>
+template <typename OutIter>
+size_t BlockingRing<Ring>::try_pop_n(OutIter out, size_t max)
+{
+  size_t n = m_ring.try_pop_n(out, max);
+  notify(m_pops, m_push_waiters, n);
+  return n;
+}
+
+template <typename Ring>
+void BlockingRing<Ring>::commit(const RingSlice<value_type>& slice)
+{
+  m_ring.commit(slice);
+  notify(m_pushes, m_pop_waiters, slice.count);
+}
+
+template <typename Ring>
+void BlockingRing<Ring>::release(const RingSlice<value_type>& slice)
+{
+  m_ring.release(slice);
+  notify(m_pops, m_push_waiters, slice.count);
+}
+
+template <typename Ring>
+template <typename U>
+void BlockingRing<Ring>::push(U&& value)
+{
+  Ring& ring = m_ring;
+  wait_for([&ring, &value] { return ring.try_push(std::forward<U>(value)); },
+           m_push_spins, m_pops, m_push_waiters);
+  notify(m_pushes, m_pop_waiters, 1);
+}
+
+template <typename Ring>
+void BlockingRing<Ring>::pop(value_type& value)
+{
+  Ring& ring = m_ring;
+  wait_for([&ring, &value] { return ring.try_pop(value); }, m_pop_spins, m_pushes, m_pop_waiters);
+  notify(m_pops, m_push_waiters, 1);
+}
+
+// Pushes as much as fits at a time until all count values are in
+template <typename Ring>
+template <typename Iter>
+void BlockingRing<Ring>::push_n(Iter first, size_t count)
+{
+  Ring& ring = m_ring;
+  while (count > 0) {
+    size_t n = 0;
+    wait_for([&ring, &first, &n, count] { n = ring.try_push_n(first, count); return n > 0; },
+             m_push_spins, m_pops, m_push_waiters);
+    notify(m_pushes, m_pop_waiters, n);
+    std::advance(first, n);
+    count -= n;
+  }
+}
+
+template <typename Ring>
+template <typename OutIter>
+size_t BlockingRing<Ring>::pop_n(OutIter out, size_t max)
+{
+  if (max == 0) {
+    return 0;
+  }
+  Ring& ring = m_ring;
+  size_t n = 0;
+  wait_for([&ring, &out, &n, max] { n = ring.try_pop_n(out, max); return n > 0; },
+           m_pop_spins, m_pushes, m_pop_waiters);
+  notify(m_pops, m_push_waiters, n);
+  return n;
+}
+
+#endif /* _H_RINGBUFFER */
@@ -0,0 +1,152 @@
+#include "RingBuffer.h"
+
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+const long ITEMS = 200000;
+const size_t MAX_BATCH = 7;
+
+typedef unique_ptr<long> Item; // move-only, and a lost or doubled move shows as NULL
+
+// Takes up to want of the values still to be consumed, so that a consumer
+// never waits for a value another consumer is going to get
+static long claim(atomic<long>& remaining, long want)
+{
+  long left = remaining.load();
+  while (left > 0 && !remaining.compare_exchange_weak(left, left - min(left, want))) {
+  }
+  return left > 0 ? min(left, want) : 0;
+}
+
+// Producers hand 1..ITEMS over in a random mix of push, push_n and
+// reserve/commit, consumers take them with pop, pop_n and peek/release; the
+// sum of what came out must be the sum of what went in
+template <typename Ring>
+static bool stress(const char* name, int producers, int consumers)
+{
+  static Ring ring;
+  long per_producer = ITEMS / producers;
+  long total = per_producer * producers;
+  atomic<long> remaining(total);
+  atomic<long> sum(0), received(0), empty(0);
+
+  vector<thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.push_back(thread([&, p] {
+      mt19937 random(p);
+      long next = p * per_producer + 1, end = next + per_producer;
+      while (next < end) {
+        size_t want = min<long>(1 + random() % MAX_BATCH, end - next);
+        switch (random() % 3) {
+        case 0:
+          ring.push(Item(new long(next++)));
+          break;
+        case 1: {
+          vector<Item> batch;
+          for (size_t i = 0; i < want; i++) {
+            batch.push_back(Item(new long(next++)));
+          }
+          ring.push_n(batch.begin(), batch.size());
+          break;
+        }
+        default: {
+          RingSlice<Item> slice = ring.reserve(want);
+          for (size_t i = 0; i < slice.count; i++) {
+            slice.data[i].reset(new long(next++));
+          }
+          ring.commit(slice);
+          if (slice.count == 0) {
+            this_thread::yield();
+          }
+        }
+        }
+      }
+    }));
+  }
+  for (int c = 0; c < consumers; c++) {
+    threads.push_back(thread([&, c] {
+      mt19937 random(100 + c);
+      long local = 0, count = 0, nulls = 0;
+      for (;;) {
+        long want = claim(remaining, 1 + random() % MAX_BATCH);
+        if (want == 0) {
+          break;
+        }
+        while (want > 0) {
+          Item batch[MAX_BATCH];
+          size_t got = 0;
+          switch (random() % 3) {
+          case 0:
+            ring.pop(batch[0]);
+            got = 1;
+            break;
+          case 1:
+            got = ring.pop_n(batch, want);
+            break;
+          default: {
+            RingSlice<Item> slice = ring.peek(want);
+            for (size_t i = 0; i < slice.count; i++) {
+              batch[i] = std::move(slice.data[i]);
+            }
+            ring.release(slice);
+            got = slice.count;
+            if (got == 0) {
+              this_thread::yield();
+            }
+          }
+          }
+          for (size_t i = 0; i < got; i++) {
+            if (batch[i]) {
+              local += *batch[i];
+            } else {
+              nulls++;
+            }
+          }
+          count += got;
+          want -= got;
+        }
+      }
+      sum += local;
+      received += count;
+      empty += nulls;
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  bool ok = received == total && empty == 0 && sum == total * (total + 1) / 2 && ring.empty();
+  cout << name << " " << producers << ":" << consumers << " moved " << received << " items, "
+       << (ok ? "sums match" : "FAILED") << endl;
+  return ok;
+}
+
+int main()
+{
+  bool ok = true;
+  ok &= stress<BlockingRingBuffer<Item, 8, SPSC> >("SPSC", 1, 1);
+  ok &= stress<BlockingRingBuffer<Item, 16, MPMC> >("MPMC", 3, 3);
+  ok &= stress<BlockingRingBuffer<Item, 4, MPMC> >("MPMC", 1, 4);
+  ok &= stress<BlockingRingBuffer<Item, 8, MPMC> >("MPMC", 4, 1);
+
+  // a reserved run stops at the end of the slot array; the rest of the
+  // free slots come with the next reserve()
+  RingBuffer<int, 8, SPSC> ring;
+  int values[6] = {1, 2, 3, 4, 5, 6};
+  ring.try_push_n(values, 6);
+  ring.try_pop_n(values, 6);
+  RingSlice<int> first = ring.reserve(8);
+  ring.commit(first);
+  RingSlice<int> second = ring.reserve(8);
+  ring.commit(second);
+  cout << "Reserved 8 slots as " << first.count << " + " << second.count << endl;
+  ok &= first.count == 2 && second.count == 6 && ring.size() == 8;
+
+  cout << (ok ? "Done" : "FAILED") << endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#ifndef _H_CANCELLATION
+#define _H_CANCELLATION
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <utility>
+
+using namespace std;
+
+// Cooperative cancellation. A CancellationSource hands out tokens that all
+// see its cancel(). Nothing is interrupted: queued work wrapped with
+// cancellable() (or submitted with ThreadPool::submit_with_token()) is
+// skipped when it comes up, running work has to poll is_cancelled() itself.
+// Checking a token is one atomic load; copying one is a reference count.
+class CancellationToken
+{
+public:
+  CancellationToken() {} // never cancelled
+  bool is_cancelled() const
+  {
+    return m_cancelled != NULL && m_cancelled->load(memory_order_acquire);
+  }
+private:
+  friend class CancellationSource;
+  explicit CancellationToken(const shared_ptr<atomic<bool> >& cancelled) :
+    m_cancelled(cancelled) {}
+
+  shared_ptr<atomic<bool> > m_cancelled;
+};
+
+class CancellationSource
+{
+public:
+  CancellationSource() : m_cancelled(make_shared<atomic<bool> >(false)) {}
+  void cancel() { m_cancelled->store(true, memory_order_release); }
+  bool is_cancelled() const { return m_cancelled->load(memory_order_acquire); }
+  CancellationToken token() const { return CancellationToken(m_cancelled); }
+private:
+  shared_ptr<atomic<bool> > m_cancelled;
+};
+
+// What get() throws for a submit_with_token() task that was skipped
+class TaskCancelled : public exception
+{
+public:
+  const char* what() const noexcept { return "task was cancelled before it ran"; }
+};
+
+// Wraps fn so it does nothing if token was cancelled by the time it runs,
+// e.g. pool.add_task(cancellable(token, [] { ... }));
+template <typename Function>
+auto cancellable(const CancellationToken& token, Function&& fn)
+{
+  return [token, fn = std::forward<Function>(fn)]() mutable {
+    if (!token.is_cancelled()) {
+      fn();
+    }
+  };
+}
+
+#endif /* _H_CANCELLATION */
@@ -0,0 +1,312 @@
+#ifndef _H_COROUTINE
+#define _H_COROUTINE
+
+#if !defined(__cpp_impl_coroutine)
+#error "Coroutine.h needs C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+// C++20 coroutines on top of ThreadPool, e.g.
+//
+//   CoTask<int> stage(ThreadPool& pool, Future<int> input)
+//   {
+//     co_await pool.schedule();  // continue on a pool worker
+//     int x = co_await std::move(input); // suspend until it completes
+//     co_return x * 2;
+//   }
+//   ...
+//   Future<int> result = stage(pool, pool.submit(...)).start();
+//
+// A suspended coroutine is just its heap frame; it holds no thread. It is
+// resumed by a pool Task (schedule()) or by whichever thread completes the
+// future it waits for, so a few workers can serve any number of coroutines
+// in flight. Awaiting a CoTask resumes it with symmetric transfer and it
+// hands control straight back to its awaiter when it finishes, so long
+// chains of coroutines do not grow the stack (GCC and Clang only emit the
+// transfer as a tail call with optimisation on).
+
+// What co_await pool.schedule() returns: suspends the coroutine and queues
+// a Task on the pool that resumes it. If the pool refuses the Task (it is
+// shutting down) the coroutine simply continues on the current thread.
+// If the pool accepts the Task but destroys it without running it (dropped
+// by OVERFLOW_DROP_OLDEST, discarded by destroy_threadpool() or
+// SHUTDOWN_DISCARD), the coroutine is resumed right there, on the thread
+// destroying the Task, and the co_await throws BrokenPromise. Unless the
+// coroutine catches it that fails the Future of CoTask::start(), and the
+// frames are freed as usual; nothing is left suspended for good.
+class ScheduleAwaitable
+{
+public:
+  ScheduleAwaitable(ThreadPool& pool, int priority) : m_pool(pool), m_priority(priority),
+    m_refused(false), m_dropped(false) {}
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(coroutine_handle<> handle)
+  {
+    // add_tasks() leaves a refused Task with us, so it can be told apart
+    // from one that is dropped later
+    Task task(Resumption(handle, this));
+    if (m_pool.add_tasks(&task, 1, m_priority) < 0) {
+      m_refused = true; // task is destroyed below without resuming anything
+      return false;
+    }
+    // queued or TASK_RAN_ON_CALLER: the coroutine may already be running
+    // (or gone) elsewhere, stay out of its way
+    return true;
+  }
+  void await_resume() const
+  {
+    if (m_dropped) {
+      throw BrokenPromise();
+    }
+  }
+private:
+  // The queued Task. Lives until it runs or is destroyed; while it has not
+  // run, the coroutine (and the awaitable in its frame) is still suspended.
+  class Resumption
+  {
+  public:
+    Resumption(coroutine_handle<> handle, ScheduleAwaitable* awaitable)
+      : m_handle(handle), m_awaitable(awaitable) {}
+    Resumption(Resumption&& other) noexcept : m_handle(other.m_handle),
+      m_awaitable(other.m_awaitable)
+    {
+      other.m_awaitable = NULL;
+    }
+    ~Resumption()
+    {
+      if (m_awaitable != NULL && !m_awaitable->m_refused) {
+        m_awaitable->m_dropped = true;
+        m_handle.resume();
+      }
+    }
+    void operator()()
+    {
+      m_awaitable = NULL;
+      m_handle.resume();
+    }
+  private:
+    Resumption(const Resumption&);
+    Resumption& operator=(const Resumption&);
+
+    coroutine_handle<> m_handle;
+    ScheduleAwaitable* m_awaitable; // NULL once run or moved from
+  };
+
+  ThreadPool& m_pool;
+  int m_priority;
+  bool m_refused;
+  bool m_dropped;
+};
+
+inline ScheduleAwaitable ThreadPool::schedule(int priority)
+{
+  return ScheduleAwaitable(*this, priority);
+}
+
+template <typename T> class CoTask;
+
+// Parts of a CoTask's promise that do not depend on the result type
+class CoTaskPromiseBase
+{
+public:
+  // When the coroutine finishes, transfer straight to whoever awaited it
+  struct FinalAwaiter
+  {
+    bool await_ready() const noexcept { return false; }
+    template <typename Promise>
+    coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept
+    {
+      coroutine_handle<> continuation = handle.promise().m_continuation;
+      return continuation ? continuation : noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+  };
+
+  suspend_always initial_suspend() const noexcept { return suspend_always(); } // lazy
+  FinalAwaiter final_suspend() const noexcept { return FinalAwaiter(); }
+  void unhandled_exception() { m_error = current_exception(); }
+
+  coroutine_handle<> m_continuation;
+  exception_ptr m_error;
+};
+
+template <typename T>
+class CoTaskPromise : public CoTaskPromiseBase
+{
+public:
+  CoTask<T> get_return_object();
+  template <typename Value>
+  void return_value(Value&& value) { m_value.emplace(std::forward<Value>(value)); }
+  T result()
+  {
+    if (m_error) {
+      rethrow_exception(m_error);
+    }
+    return std::move(*m_value);
+  }
+private:
+  optional<T> m_value;
+};
+
+template <>
+class CoTaskPromise<void> : public CoTaskPromiseBase
+{
+public:
+  CoTask<void> get_return_object();
+  void return_void() {}
+  void result()
+  {
+    if (m_error) {
+      rethrow_exception(m_error);
+    }
+  }
+};
+
+// A lazily started coroutine producing a T. Move-only; it owns the
+// coroutine frame. Either co_await it from another coroutine (it starts
+// then, on the awaiting thread) or start() it from ordinary code.
+template <typename T = void>
+class CoTask
+{
+public:
+  typedef CoTaskPromise<T> promise_type;
+  typedef coroutine_handle<promise_type> handle_type;
+
+  CoTask() {}
+  explicit CoTask(handle_type handle) : m_handle(handle) {}
+  CoTask(CoTask&& other) noexcept : m_handle(other.m_handle) { other.m_handle = handle_type(); }
+  CoTask& operator=(CoTask&& other) noexcept
+  {
+    if (this != &other) {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+      m_handle = other.m_handle;
+      other.m_handle = handle_type();
+    }
+    return *this;
+  }
+  ~CoTask()
+  {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  struct Awaiter
+  {
+    handle_type handle;
+    bool await_ready() const noexcept { return handle.done(); }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+    {
+      handle.promise().m_continuation = awaiting;
+      return handle; // symmetric transfer, no nested resume()
+    }
+    T await_resume() { return handle.promise().result(); }
+  };
+  // Throws BrokenPromise for an empty (default-constructed or moved-from)
+  // CoTask, there is no coroutine to run
+  Awaiter operator co_await() &&
+  {
+    if (!m_handle) {
+      throw BrokenPromise();
+    }
+    return Awaiter{m_handle};
+  }
+
+  // Runs the coroutine on the calling thread up to its first suspension and
+  // returns a Future for its result. The CoTask is consumed.
+  Future<T> start();
+private:
+  CoTask(const CoTask&);
+  CoTask& operator=(const CoTask&);
+
+  handle_type m_handle;
+};
+
+template <typename T>
+CoTask<T> CoTaskPromise<T>::get_return_object()
+{
+  return CoTask<T>(coroutine_handle<CoTaskPromise<T> >::from_promise(*this));
+}
+
+inline CoTask<void> CoTaskPromise<void>::get_return_object()
+{
+  return CoTask<void>(coroutine_handle<CoTaskPromise<void> >::from_promise(*this));
+}
+
+// Fire-and-forget driver behind CoTask::start(): runs eagerly and frees its
+// own frame when done
+class DetachedCoroutine
+{
+public:
+  struct promise_type
+  {
+    DetachedCoroutine get_return_object() const noexcept { return DetachedCoroutine(); }
+    suspend_never initial_suspend() const noexcept { return suspend_never(); }
+    suspend_never final_suspend() const noexcept { return suspend_never(); }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { terminate(); } // drive() catches everything
+  };
+};
+
+template <typename T>
+DetachedCoroutine drive(CoTask<T> task, shared_ptr<FutureState<T> > state)
+{
+  try {
+    if constexpr (is_void<T>::value) {
+      co_await std::move(task);
+      state->set_value();
+    } else {
+      state->set_value(co_await std::move(task));
+    }
+  } catch (...) {
+    state->set_exception(current_exception());
+  }
+}
+
+template <typename T>
+Future<T> CoTask<T>::start()
+{
+  shared_ptr<FutureState<T> > state = make_shared<FutureState<T> >();
+  Future<T> future(state);
+  drive(std::move(*this), state);
+  return future;
+}
+
+// co_await on a Future suspends until it completes; the coroutine is then
+// resumed on the thread that completed it. The future is consumed, so it
+// has to be an rvalue: co_await std::move(future).
+template <typename T>
+class FutureAwaiter
+{
+public:
+  explicit FutureAwaiter(Future<T>&& future) : m_future(std::move(future)) {}
+  bool await_ready() const { return m_future.is_ready(); }
+  void await_suspend(coroutine_handle<> handle)
+  {
+    // runs inline right here if the future completed in the meantime
+    m_future.shared_state()->set_continuation(Task([handle] { handle.resume(); }));
+  }
+  T await_resume() { return m_future.get(); }
+private:
+  Future<T> m_future;
+};
+
+template <typename T>
+FutureAwaiter<T> operator co_await(Future<T>&& future)
+{
+  return FutureAwaiter<T>(std::move(future));
+}
+
+#endif /* _H_COROUTINE */
@@ -0,0 +1,523 @@
+#ifndef _H_FUTURE
+#define _H_FUTURE
+
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+template <typename T> class Future;
+template <typename T> class Promise;
+
+// What a continuation returns when given the value of a Future<T>
+template <typename T, typename Function>
+struct ContinuationResult
+{
+  typedef decltype(declval<Function&>()(declval<T>())) type;
+};
+
+template <typename Function>
+struct ContinuationResult<void, Function>
+{
+  typedef decltype(declval<Function&>()()) type;
+};
+
+// State shared by a Promise (or a pool task) and the Future reading it.
+// Completion is a single atomic exchange; the mutex and condition variable
+// are only touched when somebody actually blocks in wait(). At most one
+// continuation can be attached, it runs inline on the thread that completes
+// the state (or right away on the attaching thread if already complete).
+// Attaching a second one throws logic_error; whoever attached the first can
+// take it off again with detach_continuation() while the state is pending.
+template <typename T>
+class FutureState
+{
+public:
+  // void futures just remember that they completed
+  typedef typename conditional<is_void<T>::value, bool, T>::type value_type;
+
+  FutureState() : m_status(PENDING), m_waiting(false) {}
+  template <typename... Values>
+  void set_value(Values&&... values);
+  void set_exception(exception_ptr error);
+  void set_continuation(Task continuation);
+  bool detach_continuation();
+  bool is_ready() const { return m_status.load(memory_order_acquire) == READY; }
+  void wait();
+
+  optional<value_type> m_value;
+  exception_ptr m_error;
+private:
+  FutureState(const FutureState&);
+  FutureState& operator=(const FutureState&);
+
+  enum { PENDING, CONTINUATION_SET, READY };
+
+  void complete();
+
+  atomic<int> m_status;
+  atomic<bool> m_waiting;
+  Mutex m_mutex;
+  CondVar m_cond_var;
+  Task m_continuation;
+};
+
+template <typename T>
+template <typename... Values>
+void FutureState<T>::set_value(Values&&... values)
+{
+  m_value.emplace(std::forward<Values>(values)...);
+  complete();
+}
+
+template <typename T>
+void FutureState<T>::set_exception(exception_ptr error)
+{
+  m_error = error;
+  complete();
+}
+
+template <typename T>
+void FutureState<T>::complete()
+{
+  int previous = m_status.exchange(READY, memory_order_seq_cst);
+  if (m_waiting.load(memory_order_seq_cst)) {
+    m_mutex.lock();
+    m_cond_var.broadcast();
+    m_mutex.unlock();
+  }
+  if (previous == CONTINUATION_SET) {
+    Task continuation(std::move(m_continuation));
+    continuation();
+  }
+}
+
+template <typename T>
+void FutureState<T>::set_continuation(Task continuation)
+{
+  int status = m_status.load(memory_order_acquire);
+  if (status == CONTINUATION_SET) {
+    throw logic_error("future already has a continuation");
+  }
+  if (status == READY) {
+    // complete() may still be busy with an earlier, detached-too-late
+    // continuation, so leave m_continuation alone
+    continuation();
+    return;
+  }
+  m_continuation = std::move(continuation);
+  int expected = PENDING;
+  if (!m_status.compare_exchange_strong(expected, CONTINUATION_SET,
+                                        memory_order_acq_rel)) {
+    if (expected == CONTINUATION_SET) {
+      Task dropped(std::move(m_continuation));
+      throw logic_error("future already has a continuation");
+    }
+    // already completed, nobody else will run it
+    Task now(std::move(m_continuation));
+    now();
+  }
+}
+
+// Takes the continuation off a state that has not completed yet, so that
+// another one can be attached. Returns false if it is too late: the state
+// completed and the continuation has run or is running.
+template <typename T>
+bool FutureState<T>::detach_continuation()
+{
+  int expected = CONTINUATION_SET;
+  if (!m_status.compare_exchange_strong(expected, PENDING, memory_order_acq_rel)) {
+    return false;
+  }
+  Task dropped(std::move(m_continuation));
+  return true;
+}
+
+template <typename T>
+void FutureState<T>::wait()
+{
+  if (is_ready()) {
+    return;
+  }
+
+  // A worker must not block: the task it waits for may be queued behind it.
+  // Keep the worker busy with other tasks instead.
+  ThreadPool* pool = ThreadPool::current_pool();
+  if (pool != NULL) {
+    while (!is_ready()) {
+      if (!pool->run_pending_task()) {
+        sched_yield();
+      }
+    }
+    return;
+  }
+
+  m_mutex.lock();
+  m_waiting.store(true, memory_order_seq_cst);
+  while (m_status.load(memory_order_seq_cst) != READY) {
+    m_cond_var.wait(m_mutex.get_mutex_ptr());
+  }
+  m_mutex.unlock();
+}
+
+// Runs fn and stores its result (or the exception it threw) in state
+template <typename T, typename Function>
+void fulfil(FutureState<T>& state, Function&& fn)
+{
+  try {
+    if constexpr (is_void<T>::value) {
+      fn();
+      state.set_value();
+    } else {
+      state.set_value(fn());
+    }
+  } catch (...) {
+    state.set_exception(current_exception());
+  }
+}
+
+// Read side of a FutureState. Move-only: get() hands the value out once.
+template <typename T>
+class Future
+{
+public:
+  Future() {}
+  explicit Future(const shared_ptr<FutureState<T> >& state) : m_state(state) {}
+  Future(Future&& other) : m_state(std::move(other.m_state)) {}
+  Future& operator=(Future&& other) { m_state = std::move(other.m_state); return *this; }
+  bool valid() const { return m_state != NULL; }
+  bool is_ready() const { return m_state->is_ready(); }
+  void wait() const { m_state->wait(); }
+  T get();
+  template <typename Function>
+  Future<typename ContinuationResult<T, Function>::type> then(Function&& fn);
+  // for combinators such as when_all() that attach to the state directly
+  FutureState<T>* shared_state() const { return m_state.get(); }
+private:
+  Future(const Future&);
+  Future& operator=(const Future&);
+
+  shared_ptr<FutureState<T> > m_state;
+};
+
+// Waits for the value and returns it, or rethrows what the task threw
+template <typename T>
+T Future<T>::get()
+{
+  m_state->wait();
+  shared_ptr<FutureState<T> > state = std::move(m_state);
+  if (state->m_error) {
+    rethrow_exception(state->m_error);
+  }
+  if constexpr (!is_void<T>::value) {
+    return std::move(*state->m_value);
+  }
+}
+
+// Attaches fn to run once this future completes and returns a future for
+// fn's result. fn runs inline on the thread that completes this future, so
+// it should be short; longer work should be submitted to a pool from it.
+// If this future failed, fn is skipped and the error propagates.
+// The future is consumed, it is no longer valid() afterwards.
+template <typename T>
+template <typename Function>
+Future<typename ContinuationResult<T, Function>::type> Future<T>::then(Function&& fn)
+{
+  typedef typename ContinuationResult<T, Function>::type U;
+  shared_ptr<FutureState<T> > source = std::move(m_state);
+  shared_ptr<FutureState<U> > target = make_shared<FutureState<U> >();
+
+  // source stays alive while it completes (its producer holds a reference),
+  // so a raw pointer is enough and avoids a cycle through the continuation
+  FutureState<T>* state = source.get();
+  source->set_continuation(Task(
+    [state, target, fn = std::forward<Function>(fn)]() mutable {
+      if (state->m_error) {
+        target->set_exception(state->m_error);
+        return;
+      }
+      if constexpr (is_void<T>::value) {
+        fulfil(*target, fn);
+      } else {
+        fulfil(*target, [&] { return fn(std::move(*state->m_value)); });
+      }
+    }));
+  return Future<U>(target);
+}
+
+// Write side, for results that are not produced by ThreadPool::submit()
+template <typename T>
+class Promise
+{
+public:
+  Promise() : m_state(make_shared<FutureState<T> >()) {}
+  Future<T> get_future() { return Future<T>(m_state); }
+  template <typename... Values>
+  void set_value(Values&&... values) { m_state->set_value(std::forward<Values>(values)...); }
+  void set_exception(exception_ptr error) { m_state->set_exception(error); }
+private:
+  shared_ptr<FutureState<T> > m_state;
+};
+
+// What get() throws when the task that should have produced the value was
+// destroyed without running, e.g. refused or dropped by the overflow policy
+class BrokenPromise : public exception
+{
+public:
+  const char* what() const noexcept { return "task was dropped before it ran"; }
+};
+
+// Producing end of a FutureState carried inside a queued Task. If the Task
+// is destroyed before it ran, the future fails with BrokenPromise instead of
+// never completing.
+template <typename T>
+class PromiseGuard
+{
+public:
+  explicit PromiseGuard(const shared_ptr<FutureState<T> >& state) : m_state(state) {}
+  PromiseGuard(PromiseGuard&& other) noexcept : m_state(std::move(other.m_state)) {}
+  ~PromiseGuard()
+  {
+    if (m_state != NULL && !m_state->is_ready()) {
+      m_state->set_exception(make_exception_ptr(BrokenPromise()));
+    }
+  }
+  FutureState<T>& operator*() const { return *m_state; }
+private:
+  PromiseGuard(const PromiseGuard&);
+  PromiseGuard& operator=(const PromiseGuard&);
+
+  shared_ptr<FutureState<T> > m_state;
+};
+
+// If the pool refuses the task (see ThreadPoolOptions::overflow_policy) the
+// returned future fails with BrokenPromise.
+template <typename Function, typename... Args>
+Future<typename TaskResult<Function, Args...>::type>
+ThreadPool::submit(Function&& fn, Args&&... args)
+{
+  return submit_task(PRIORITY_NORMAL, ANY_NODE, std::forward<Function>(fn),
+                     std::forward<Args>(args)...);
+}
+
+template <typename Function, typename... Args>
+Future<typename TaskResult<Function, Args...>::type>
+ThreadPool::submit_with_priority(int priority, Function&& fn, Args&&... args)
+{
+  return submit_task(priority, ANY_NODE, std::forward<Function>(fn),
+                     std::forward<Args>(args)...);
+}
+
+// fn is skipped if token is cancelled by the time the task comes up; the
+// future then fails with TaskCancelled. A running fn is not interrupted, it
+// may poll the token itself.
+template <typename Function, typename... Args>
+Future<typename TaskResult<Function, Args...>::type>
+ThreadPool::submit_with_token(const CancellationToken& token, Function&& fn, Args&&... args)
+{
+  typedef typename TaskResult<Function, Args...>::type R;
+  shared_ptr<FutureState<R> > state = make_shared<FutureState<R> >();
+  Future<R> future(state);
+  add_task(Task(
+    [guard = PromiseGuard<R>(state), token, fn = std::forward<Function>(fn),
+     args = make_tuple(std::forward<Args>(args)...)]() mutable {
+      if (token.is_cancelled()) {
+        (*guard).set_exception(make_exception_ptr(TaskCancelled()));
+        return;
+      }
+      fulfil(*guard, [&]() -> R { return std::apply(fn, std::move(args)); });
+    }));
+  return future;
+}
+
+// Queues on the given node's lanes, e.g. next to the memory fn works on
+template <typename Function, typename... Args>
+Future<typename TaskResult<Function, Args...>::type>
+ThreadPool::submit_on_node(int node, Function&& fn, Args&&... args)
+{
+  return submit_task(PRIORITY_NORMAL, node, std::forward<Function>(fn),
+                     std::forward<Args>(args)...);
+}
+
+template <typename Function, typename... Args>
+Future<typename TaskResult<Function, Args...>::type>
+ThreadPool::submit_task(int priority, int node, Function&& fn, Args&&... args)
+{
+  typedef typename TaskResult<Function, Args...>::type R;
+  shared_ptr<FutureState<R> > state = make_shared<FutureState<R> >();
+  Future<R> future(state);
+  add_task(Task(
+    [guard = PromiseGuard<R>(state), fn = std::forward<Function>(fn),
+     args = make_tuple(std::forward<Args>(args)...)]() mutable {
+      fulfil(*guard, [&]() -> R { return std::apply(fn, std::move(args)); });
+    }), priority, node);
+  return future;
+}
+
+// Completes once every future in the list has completed. The values come
+// back in the same order; if any future failed the result carries the
+// first error seen instead.
+// The returned future owns the bookkeeping (and through it the inputs),
+// the inputs' continuations only hold a weak reference to it. Otherwise an
+// input that never completes would keep itself, the bookkeeping and every
+// other input alive in a cycle.
+template <typename T>
+Future<typename conditional<is_void<T>::value, void, vector<T> >::type>
+when_all(vector<Future<T> > futures)
+{
+  typedef typename conditional<is_void<T>::value, void, vector<T> >::type R;
+  typedef typename FutureState<T>::value_type V;
+
+  struct Context
+  {
+    atomic<size_t> remaining;
+    atomic<bool> failed;
+    exception_ptr error;
+    vector<optional<V> > values;
+    vector<Future<T> > futures; // keeps the source states alive
+    FutureState<R> target;
+
+    void finish()
+    {
+      if (failed.load(memory_order_acquire)) {
+        target.set_exception(error);
+      } else if constexpr (is_void<T>::value) {
+        target.set_value();
+      } else {
+        R result;
+        result.reserve(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+          result.push_back(std::move(*values[i]));
+        }
+        target.set_value(std::move(result));
+      }
+    }
+  };
+
+  shared_ptr<Context> context = make_shared<Context>();
+  context->remaining.store(futures.size() + 1, memory_order_relaxed);
+  context->failed.store(false, memory_order_relaxed);
+  context->values.resize(futures.size());
+  context->futures = std::move(futures);
+  Future<R> result(shared_ptr<FutureState<R> >(context, &context->target));
+  weak_ptr<Context> weak(context);
+
+  for (size_t i = 0; i < context->futures.size(); i++) {
+    FutureState<T>* state = context->futures[i].shared_state();
+    state->set_continuation(Task([i, state, weak] {
+      shared_ptr<Context> context = weak.lock();
+      if (context == NULL) {
+        return; // nobody is waiting for the result any more
+      }
+      if (state->m_error) {
+        if (!context->failed.exchange(true, memory_order_acq_rel)) {
+          context->error = state->m_error;
+        }
+      } else {
+        context->values[i] = std::move(state->m_value);
+      }
+      if (context->remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+        context->finish();
+      }
+    }));
+  }
+  // the extra count keeps finish() from running while we are still attaching
+  if (context->remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+    context->finish();
+  }
+  return result;
+}
+
+// Result of when_any(): which future completed first, plus all the futures
+// so the caller can get() the winner and keep waiting on the rest, e.g. with
+// another when_any() over the losers.
+template <typename T>
+class WhenAnyResult
+{
+public:
+  size_t index;
+  vector<Future<T> > futures;
+};
+
+// Completes as soon as one future in the list completes (successfully or
+// not). An empty list completes right away with index == 0.
+// As with when_all(), the returned future owns the bookkeeping and the
+// inputs only point back at it weakly. Before the inputs are handed over
+// to the result, the losers' continuations are detached again, so the
+// futures come back as if when_any() had never touched them.
+template <typename T>
+Future<WhenAnyResult<T> > when_any(vector<Future<T> > futures)
+{
+  struct Context
+  {
+    atomic<bool> done;
+    atomic<int> pending;  // the winner and the attaching loop, see finish()
+    size_t index;
+    vector<FutureState<T>*> states;
+    vector<Future<T> > futures;
+    FutureState<WhenAnyResult<T> > target;
+
+    // Runs once there is a winner and every continuation is attached, so
+    // none is attached again after it was detached
+    void finish()
+    {
+      for (size_t i = 0; i < states.size(); i++) {
+        if (i != index) {
+          states[i]->detach_continuation(); // false: completed, it ran and did nothing
+        }
+      }
+      WhenAnyResult<T> winner;
+      winner.index = index;
+      winner.futures = std::move(futures);
+      target.set_value(std::move(winner));
+    }
+  };
+
+  shared_ptr<Context> context = make_shared<Context>();
+  context->done.store(false, memory_order_relaxed);
+  context->pending.store(2, memory_order_relaxed);
+  Future<WhenAnyResult<T> > result(
+    shared_ptr<FutureState<WhenAnyResult<T> > >(context, &context->target));
+
+  if (futures.empty()) {
+    WhenAnyResult<T> none;
+    none.index = 0;
+    context->target.set_value(std::move(none));
+    return result;
+  }
+
+  for (size_t i = 0; i < futures.size(); i++) {
+    context->states.push_back(futures[i].shared_state());
+  }
+  context->futures = std::move(futures);
+  weak_ptr<Context> weak(context);
+
+  for (size_t i = 0; i < context->states.size(); i++) {
+    context->states[i]->set_continuation(Task([i, weak] {
+      shared_ptr<Context> context = weak.lock();
+      if (context == NULL) {
+        return; // nobody is waiting for the result any more
+      }
+      if (!context->done.exchange(true, memory_order_acq_rel)) {
+        context->index = i;
+        if (context->pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+          context->finish();
+        }
+      }
+    }));
+  }
+  if (context->pending.fetch_sub(1, memory_order_acq_rel) == 1) {
+    context->finish();
+  }
+  return result;
+}
+
+#endif /* _H_FUTURE */
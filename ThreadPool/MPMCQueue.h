@@ -0,0 +1,189 @@
+#ifndef _H_MPMCQUEUE
+#define _H_MPMCQUEUE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <utility>
+
+#include "Platform.h"
+
+using namespace std;
+
+const int DEFAULT_QUEUE_CAPACITY = 8192;
+
+// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's
+// design). Every cell carries a sequence number that tells producers and
+// consumers whose turn it is:
+//   sequence == pos      cell is free for the producer that claims pos
+//   sequence == pos + 1  cell holds the value for the consumer that claims pos
+// Producers and consumers only contend on their own counter (m_enqueue_pos /
+// m_dequeue_pos), which live on separate cache lines. Values are stored in
+// the cells by value and moved in and out, so T only has to be movable.
+template <typename T>
+class MPMCQueue
+{
+public:
+  MPMCQueue(size_t capacity = DEFAULT_QUEUE_CAPACITY);
+  ~MPMCQueue();
+  bool try_enqueue(T&& value);
+  template <typename Iter>
+  size_t try_enqueue_bulk(Iter first, size_t count);
+  bool try_dequeue(T& value);
+  bool empty() const;
+  size_t size() const;
+  size_t capacity() const { return m_mask + 1; }
+private:
+  MPMCQueue(const MPMCQueue&);
+  MPMCQueue& operator=(const MPMCQueue&);
+
+  struct Cell
+  {
+    atomic<size_t> sequence;
+    T data;
+  };
+
+  alignas(CACHE_LINE_SIZE) Cell* m_buffer;
+  size_t m_mask;
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_enqueue_pos;
+  alignas(CACHE_LINE_SIZE) atomic<size_t> m_dequeue_pos;
+};
+
+template <typename T>
+MPMCQueue<T>::MPMCQueue(size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0)
+{
+  // round the capacity up to a power of two so we can mask instead of mod
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  m_mask = size - 1;
+  m_buffer = new Cell[size];
+  for (size_t i = 0; i < size; i++) {
+    m_buffer[i].sequence.store(i, memory_order_relaxed);
+  }
+}
+
+template <typename T>
+MPMCQueue<T>::~MPMCQueue()
+{
+  delete[] m_buffer;
+}
+
+// value is only moved from when the call succeeds
+template <typename T>
+bool MPMCQueue<T>::try_enqueue(T&& value)
+{
+  Cell* cell;
+  size_t pos = m_enqueue_pos.load(memory_order_relaxed);
+  while (true) {
+    cell = &m_buffer[pos & m_mask];
+    size_t seq = cell->sequence.load(memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      // cell is free, try to claim it
+      if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // full: the consumer of the previous lap is not done yet
+    } else {
+      pos = m_enqueue_pos.load(memory_order_relaxed); // someone beat us to it
+    }
+  }
+  cell->data = std::move(value);
+  cell->sequence.store(pos + 1, memory_order_release);
+  return true;
+}
+
+// Moves up to count values from first into the queue with a single CAS on
+// m_enqueue_pos and returns how many made it in. Only the leading run of free cells is
+// claimed, so a batch larger than the free space is enqueued partially and
+// the caller retries with the rest.
+template <typename T>
+template <typename Iter>
+size_t MPMCQueue<T>::try_enqueue_bulk(Iter first, size_t count)
+{
+  size_t pos = m_enqueue_pos.load(memory_order_relaxed);
+  size_t claimed = 0;
+  while (count > 0) {
+    claimed = 0;
+    while (claimed < count) {
+      Cell* cell = &m_buffer[(pos + claimed) & m_mask];
+      size_t seq = cell->sequence.load(memory_order_acquire);
+      if (seq != pos + claimed) {
+        break;
+      }
+      claimed++;
+    }
+
+    if (claimed == 0) {
+      size_t seq = m_buffer[pos & m_mask].sequence.load(memory_order_acquire);
+      if ((intptr_t) seq - (intptr_t) pos < 0) {
+        return 0; // full
+      }
+      pos = m_enqueue_pos.load(memory_order_relaxed); // someone beat us to it
+      continue;
+    }
+
+    // Cells that were free stay free until their producer (us, if the CAS
+    // succeeds) fills them, so the whole run is ours after one CAS.
+    if (m_enqueue_pos.compare_exchange_weak(pos, pos + claimed,
+                                            memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < claimed; i++, ++first) {
+    Cell* cell = &m_buffer[(pos + i) & m_mask];
+    cell->data = std::move(*first);
+    cell->sequence.store(pos + i + 1, memory_order_release);
+  }
+  return claimed;
+}
+
+template <typename T>
+bool MPMCQueue<T>::try_dequeue(T& value)
+{
+  Cell* cell;
+  size_t pos = m_dequeue_pos.load(memory_order_relaxed);
+  while (true) {
+    cell = &m_buffer[pos & m_mask];
+    size_t seq = cell->sequence.load(memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (diff == 0) {
+      if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // empty: the producer of this cell is not done yet
+    } else {
+      pos = m_dequeue_pos.load(memory_order_relaxed);
+    }
+  }
+  value = std::move(cell->data);
+  // hand the cell over to the producer of the next lap
+  cell->sequence.store(pos + m_mask + 1, memory_order_release);
+  return true;
+}
+
+// empty() and size() are only snapshots, another thread may change the
+// queue right after they return.
+template <typename T>
+bool MPMCQueue<T>::empty() const
+{
+  return size() == 0;
+}
+
+template <typename T>
+size_t MPMCQueue<T>::size() const
+{
+  size_t tail = m_enqueue_pos.load(memory_order_seq_cst);
+  size_t head = m_dequeue_pos.load(memory_order_seq_cst);
+  return tail > head ? tail - head : 0;
+}
+
+#endif /* _H_MPMCQUEUE */
@@ -0,0 +1,27 @@
+#ifndef _H_PLATFORM
+#define _H_PLATFORM
+
+#include <time.h>
+
+const int CACHE_LINE_SIZE = 64;
+
+// Hint to the CPU that we are busy-waiting, so it can back off the pipeline
+// and let the sibling hyper-thread run.
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+// Monotonic clock in nanoseconds, for measuring short intervals
+inline long monotonic_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+#endif /* _H_PLATFORM */
@@ -0,0 +1,182 @@
+#include "TaskGraph.h"
+
+#include <stdexcept>
+
+TaskGraph::TaskGraph() : m_prepared(false), m_pool(NULL), m_remaining(0),
+  m_failed(false), m_done(false)
+{
+}
+
+void TaskGraph::add_edge(NodeId from, NodeId to)
+{
+  if (from < 0 || to < 0 || from >= (NodeId) m_nodes.size() ||
+      to >= (NodeId) m_nodes.size()) {
+    throw out_of_range("TaskGraph::add_edge: no such node");
+  }
+  m_nodes[from].successors.push_back(to);
+  m_nodes[to].predecessors++;
+  m_prepared = false;
+}
+
+// Finds the roots and checks for cycles (Kahn's algorithm). Only runs after
+// the graph changed, this is where the allocations happen.
+void TaskGraph::prepare()
+{
+  size_t count = m_nodes.size();
+  m_pending.reset(new PendingCount[count]);
+  m_roots.clear();
+  for (size_t i = 0; i < count; i++) {
+    m_pending[i].count.store(m_nodes[i].predecessors, memory_order_relaxed);
+    if (m_nodes[i].predecessors == 0) {
+      m_roots.push_back((NodeId) i);
+    }
+  }
+
+  vector<NodeId> ready(m_roots);
+  size_t visited = 0;
+  while (!ready.empty()) {
+    NodeId id = ready.back();
+    ready.pop_back();
+    visited++;
+    const vector<NodeId>& successors = m_nodes[id].successors;
+    for (size_t i = 0; i < successors.size(); i++) {
+      if (m_pending[successors[i]].count.fetch_sub(1, memory_order_relaxed) == 1) {
+        ready.push_back(successors[i]);
+      }
+    }
+  }
+  if (visited != count) {
+    throw logic_error("TaskGraph has a cycle");
+  }
+
+  m_root_tasks.resize(m_roots.size());
+  m_prepared = true;
+}
+
+void TaskGraph::run(ThreadPool& pool)
+{
+  if (m_nodes.empty()) {
+    return;
+  }
+  if (!m_prepared) {
+    prepare();
+  }
+
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    m_pending[i].count.store(m_nodes[i].predecessors, memory_order_relaxed);
+  }
+  m_pool = &pool;
+  m_failed.store(false, memory_order_relaxed);
+  m_error = NULL;
+  m_done.store(false, memory_order_relaxed);
+  m_remaining.store((int) m_nodes.size(), memory_order_release);
+
+  for (size_t i = 0; i < m_roots.size(); i++) {
+    NodeId id = m_roots[i];
+    m_root_tasks[i] = Task(NodeTask(this, id));
+  }
+  pool.add_tasks(m_root_tasks.begin(), m_root_tasks.end());
+  // whatever the pool refused is still in the batch, run it here
+  for (size_t i = 0; i < m_root_tasks.size(); i++) {
+    if (!m_root_tasks[i].empty()) {
+      Task task(std::move(m_root_tasks[i]));
+      task();
+    }
+  }
+
+  wait_for_run();
+  m_pool = NULL;
+  if (m_failed.load(memory_order_acquire)) {
+    rethrow_exception(m_error);
+  }
+}
+
+// Runs id and then keeps going with one successor it made ready
+void TaskGraph::execute(NodeId id)
+{
+  while (id >= 0) {
+    Node& node = m_nodes[id];
+    if (!m_failed.load(memory_order_relaxed)) {
+      try {
+        node.body();
+      } catch (...) {
+        if (!m_failed.exchange(true, memory_order_acq_rel)) {
+          m_error = current_exception();
+        }
+      }
+    }
+
+    NodeId next = -1;
+    for (size_t i = 0; i < node.successors.size(); i++) {
+      NodeId successor = node.successors[i];
+      // acq_rel: whoever takes the counter to zero sees the effects of every
+      // predecessor
+      if (m_pending[successor].count.fetch_sub(1, memory_order_acq_rel) == 1) {
+        if (next < 0) {
+          next = successor;
+        } else {
+          dispatch(successor);
+        }
+      }
+    }
+    finish_node(); // must be the last touch of the graph for this node
+    id = next;
+  }
+}
+
+// Once the run failed the remaining nodes are only counted down, which is
+// cheaper here than a trip through the queue. add_tasks() leaves a refused
+// Task with us (add_task() would destroy it, and its guard would abandon
+// the node), so a full queue or a shutdown just runs the node here.
+void TaskGraph::dispatch(NodeId id)
+{
+  if (m_failed.load(memory_order_relaxed)) {
+    execute(id);
+    return;
+  }
+  Task task = Task(NodeTask(this, id));
+  if (m_pool->add_tasks(&task, 1) < 0) {
+    task();
+  }
+}
+
+// The pool destroyed the node's Task without running it. Fail the run and
+// finish the node without its body, which also releases its successors.
+void TaskGraph::abandon(NodeId id)
+{
+  if (!m_failed.exchange(true, memory_order_acq_rel)) {
+    m_error = make_exception_ptr(BrokenPromise());
+  }
+  execute(id);
+}
+
+// The thread finishing the last node wakes run() under the lock, so run()
+// cannot return (and the graph go away) while it is still signalling.
+void TaskGraph::finish_node()
+{
+  if (m_remaining.fetch_sub(1, memory_order_acq_rel) == 1) {
+    m_mutex.lock();
+    m_done.store(true, memory_order_release);
+    m_cond_var.broadcast();
+    m_mutex.unlock();
+  }
+}
+
+void TaskGraph::wait_for_run()
+{
+  // a worker must not block, the nodes may be queued behind it
+  ThreadPool* pool = ThreadPool::current_pool();
+  if (pool != NULL) {
+    while (!m_done.load(memory_order_acquire)) {
+      if (!pool->run_pending_task()) {
+        sched_yield();
+      }
+    }
+  }
+
+  m_mutex.lock();
+  while (!m_done.load(memory_order_acquire)) {
+    m_cond_var.wait(m_mutex.get_mutex_ptr());
+  }
+  m_mutex.unlock();
+}
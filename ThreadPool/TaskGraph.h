@@ -0,0 +1,123 @@
+#ifndef _H_TASKGRAPH
+#define _H_TASKGRAPH
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+// A dependency graph of tasks, declared once and run as often as needed.
+// Every node keeps a counter of predecessors that have not finished yet;
+// finishing a node decrements its successors' counters and the ones that
+// reach zero are ready. The finishing thread runs one ready successor itself
+// straight away and queues the rest on the pool, so a chain never goes
+// through the queue and independent branches run in parallel.
+//
+// Running allocates nothing: the counters live with the graph and are reset
+// at the start of every run, and the pool Task for a node only holds the
+// graph pointer and node id so it is stored inline. Adding nodes or edges
+// between runs is fine (the next run re-checks the graph), running the same
+// graph twice at the same time is not.
+class TaskGraph
+{
+public:
+  typedef int NodeId;
+
+  TaskGraph();
+  template <typename Function>
+  NodeId add_node(Function&& fn);
+  void add_edge(NodeId from, NodeId to); // to runs after from has finished
+  // Runs every node on pool and returns once all have finished. If a node
+  // throws, nodes that have not started yet are skipped and the first
+  // exception is rethrown here. A node whose pool Task is destroyed without
+  // running (dropped by OVERFLOW_DROP_OLDEST, discarded at shutdown) fails
+  // the run the same way with BrokenPromise. Throws logic_error if the graph
+  // has a cycle.
+  void run(ThreadPool& pool);
+  size_t size() const { return m_nodes.size(); }
+private:
+  TaskGraph(const TaskGraph&);
+  TaskGraph& operator=(const TaskGraph&);
+
+  struct Node
+  {
+    explicit Node(Task&& fn) : body(std::move(fn)), predecessors(0) {}
+    Task body; // never moved out, so it can be called on every run
+    vector<NodeId> successors;
+    int predecessors;
+  };
+
+  // Counters are written by whichever worker finishes a predecessor, give
+  // each its own cache line
+  struct alignas(CACHE_LINE_SIZE) PendingCount
+  {
+    atomic<int> count;
+  };
+
+  // What the pool Task of a node holds. If the Task is destroyed without
+  // having run, the node is abandoned, so its successors and run() are not
+  // left waiting for it.
+  class NodeTask
+  {
+  public:
+    NodeTask(TaskGraph* graph, NodeId id) : m_graph(graph), m_id(id) {}
+    NodeTask(NodeTask&& other) noexcept : m_graph(other.m_graph), m_id(other.m_id)
+    {
+      other.m_graph = NULL;
+    }
+    ~NodeTask()
+    {
+      if (m_graph != NULL) {
+        m_graph->abandon(m_id);
+      }
+    }
+    void operator()()
+    {
+      TaskGraph* graph = m_graph;
+      m_graph = NULL; // the graph may be gone by the time we are destroyed
+      graph->execute(m_id);
+    }
+  private:
+    NodeTask(const NodeTask&);
+    NodeTask& operator=(const NodeTask&);
+
+    TaskGraph* m_graph;
+    NodeId m_id;
+  };
+
+  void prepare();
+  void execute(NodeId id);
+  void abandon(NodeId id);
+  void dispatch(NodeId id);
+  void finish_node();
+  void wait_for_run();
+
+  vector<Node> m_nodes;
+  vector<NodeId> m_roots;
+  vector<Task> m_root_tasks; // reused batch for queueing the roots
+  unique_ptr<PendingCount[]> m_pending;
+  bool m_prepared; // m_roots and m_pending match m_nodes
+
+  ThreadPool* m_pool; // of the current run
+  atomic<int> m_remaining;
+  atomic<bool> m_failed;
+  exception_ptr m_error;
+  atomic<bool> m_done;
+  Mutex m_mutex;
+  CondVar m_cond_var;
+};
+
+template <typename Function>
+TaskGraph::NodeId TaskGraph::add_node(Function&& fn)
+{
+  m_nodes.push_back(Node(Task(std::forward<Function>(fn))));
+  m_prepared = false;
+  return (NodeId) m_nodes.size() - 1;
+}
+
+#endif /* _H_TASKGRAPH */
@@ -1,34 +1,166 @@
-#include "threadpool.h"
+#include "ThreadPool.h"
 
-#include <errno.h>
+#include <sched.h>
 #include <string.h>
 
-Task::Task(void (*fn_ptr)(void*), void* arg) : m_fn_ptr(fn_ptr), m_arg(arg)
+// Adapts the classic function pointer + argument pair to a callable
+struct FunctionCall
 {
+  void (*fn_ptr)(void*);
+  void* arg;
+  void operator()() { (*fn_ptr)(arg); }
+};
+
+Task::Task() : m_ops(NULL), m_enqueue_time(0)
+{
+}
+
+Task::Task(void (*fn_ptr)(void*), void* arg) : m_enqueue_time(0)
+{
+  FunctionCall call = { fn_ptr, arg };
+  new (m_storage) FunctionCall(call);
+  m_ops = &InlineOps<FunctionCall>::ops;
+}
+
+Task::Task(Task&& other) noexcept : m_ops(other.m_ops),
+  m_enqueue_time(other.m_enqueue_time)
+{
+  if (m_ops != NULL) {
+    m_ops->move(m_storage, other.m_storage);
+    other.m_ops = NULL;
+  }
+}
+
+Task& Task::operator=(Task&& other) noexcept
+{
+  if (this != &other) {
+    reset();
+    m_ops = other.m_ops;
+    m_enqueue_time = other.m_enqueue_time;
+    if (m_ops != NULL) {
+      m_ops->move(m_storage, other.m_storage);
+      other.m_ops = NULL;
+    }
+  }
+  return *this;
 }
 
 Task::~Task()
 {
+  reset();
+}
+
+void Task::reset()
+{
+  if (m_ops != NULL) {
+    m_ops->destroy(m_storage);
+    m_ops = NULL;
+  }
 }
 
 void Task::operator()()
 {
-  (*m_fn_ptr)(m_arg);
+  m_ops->invoke(m_storage);
 }
 
 void Task::run()
 {
-  (*m_fn_ptr)(m_arg);
+  m_ops->invoke(m_storage);
 }
 
-ThreadPool::ThreadPool() : m_pool_size(DEFAULT_POOL_SIZE)
+// How often drain() looks again even without a worker parking: a thread
+// outside the pool helping out may take the last task without waking anybody
+const int DRAIN_POLL_MS = 10;
+
+// Set on every worker thread so add_task() can tell
+// whether it is being called from inside one of our own workers.
+static thread_local ThreadPool* t_current_pool = NULL;
+static thread_local int t_worker_index = -1;
+// Takes from the global queue by this thread, drives aging
+static thread_local unsigned long t_global_takes = 0;
+
+ThreadPoolOptions::ThreadPoolOptions() : min_threads(DEFAULT_MIN_THREADS),
+  max_threads(DEFAULT_POOL_SIZE), idle_timeout_ms(DEFAULT_IDLE_TIMEOUT_MS),
+  spawn_queue_depth(DEFAULT_SPAWN_QUEUE_DEPTH), scheduling_mode(GLOBAL_FIFO),
+  queue_capacity(DEFAULT_QUEUE_CAPACITY), overflow_policy(OVERFLOW_BLOCK),
+  block_timeout_ms(-1), aging_interval(DEFAULT_AGING_INTERVAL),
+  track_wait_times(false), pin_threads(false), numa_aware(false),
+  topology_file(NULL)
 {
-  cout << "Constructed ThreadPool of size " << m_pool_size << endl;
 }
 
-ThreadPool::ThreadPool(int pool_size) : m_pool_size(pool_size)
+ThreadPool::ThreadPool()
 {
-  cout << "Constructed ThreadPool of size " << m_pool_size << endl;
+  ThreadPoolOptions options;
+  options.min_threads = DEFAULT_POOL_SIZE;
+  options.max_threads = DEFAULT_POOL_SIZE;
+  init(options);
+}
+
+ThreadPool::ThreadPool(int pool_size, int scheduling_mode, int queue_capacity)
+{
+  ThreadPoolOptions options;
+  options.min_threads = pool_size;
+  options.max_threads = pool_size;
+  options.scheduling_mode = scheduling_mode;
+  options.queue_capacity = queue_capacity;
+  init(options);
+}
+
+ThreadPool::ThreadPool(const ThreadPoolOptions& options)
+{
+  init(options);
+}
+
+void ThreadPool::init(const ThreadPoolOptions& options)
+{
+  m_pool_size = options.max_threads;
+  m_min_threads = options.min_threads < m_pool_size ? options.min_threads : m_pool_size;
+  m_idle_timeout_ms = options.idle_timeout_ms;
+  m_spawn_queue_depth = options.spawn_queue_depth;
+  m_scheduling_mode = options.scheduling_mode;
+  m_overflow_policy = options.overflow_policy;
+  m_block_timeout_ms = options.block_timeout_ms;
+  m_aging_interval = options.aging_interval;
+  m_track_wait_times = options.track_wait_times;
+  m_numa_aware = options.numa_aware;
+  m_node_count = 1;
+  if (options.numa_aware || options.pin_threads) {
+    m_topology.load(options.topology_file);
+  }
+  if (m_numa_aware) {
+    m_node_count = m_topology.node_count();
+  }
+  m_rejected_tasks = 0;
+  m_dropped_tasks = 0;
+  m_discarded_tasks = 0;
+  m_pool_state = STOPPED;
+  m_accepting = true;
+  m_draining = false;
+  m_thread_count = 0;
+  m_peak_thread_count = 0;
+  m_idle_workers = 0;
+
+  m_workers.resize(m_pool_size);
+  for (int i = 0; i < m_pool_size; i++) {
+    m_workers[i].pool = this;
+    m_workers[i].index = i;
+    m_workers[i].active = false;
+  }
+  place_workers(options);
+
+  m_lanes.resize(m_node_count * NUM_PRIORITIES);
+  for (int node = 0; node < m_node_count; node++) {
+    allocate_lanes(node, options.queue_capacity);
+  }
+  m_wait_stats = new WaitStats[m_pool_size + 1];
+  for (int i = 0; i <= m_pool_size; i++) {
+    for (int j = 0; j < NUM_PRIORITIES; j++) {
+      m_wait_stats[i].dequeued[j] = 0;
+      m_wait_stats[i].total_wait_ns[j] = 0;
+      m_wait_stats[i].max_wait_ns[j] = 0;
+    }
+  }
 }
 
 ThreadPool::~ThreadPool()
@@ -37,6 +169,118 @@ ThreadPool::~ThreadPool()
   if (m_pool_state != STOPPED) {
     destroy_threadpool();
   }
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    delete m_lanes[i];
+  }
+  delete[] m_wait_stats;
+}
+
+// Worker i belongs to node i % m_node_count, so however many workers are
+// running they are spread evenly over the nodes. With pin_threads each one
+// also gets its own CPU, taken in turn from its node's CPUs (from all CPUs
+// when not numa_aware).
+void ThreadPool::place_workers(const ThreadPoolOptions& options)
+{
+  std::vector<int> all_cpus;
+  for (int node = 0; node < m_topology.node_count(); node++) {
+    const std::vector<int>& cpus = m_topology.cpus(node);
+    all_cpus.insert(all_cpus.end(), cpus.begin(), cpus.end());
+  }
+
+  for (int i = 0; i < m_pool_size; i++) {
+    Worker& worker = m_workers[i];
+    worker.node = m_numa_aware ? i % m_node_count : 0;
+    worker.cpu = -1;
+    if (options.pin_threads && m_numa_aware) {
+      const std::vector<int>& cpus = m_topology.cpus(worker.node);
+      worker.cpu = cpus[(i / m_node_count) % cpus.size()];
+    } else if (options.pin_threads) {
+      worker.cpu = all_cpus[i % all_cpus.size()];
+    }
+  }
+}
+
+// Restricts the calling thread to cpus. A fake topology may name CPUs this
+// machine does not have; without any usable one the thread keeps running
+// unbound.
+static void bind_to_cpus(const std::vector<int>& cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] < CPU_SETSIZE) {
+      CPU_SET(cpus[i], &set);
+    }
+  }
+  if (CPU_COUNT(&set) > 0) {
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+}
+
+// What a lane placement thread needs to know
+struct LanePlacement
+{
+  ThreadPool* pool;
+  int node;
+  size_t capacity;
+};
+
+extern "C"
+void* place_lanes(void* arg)
+{
+  LanePlacement* placement = (LanePlacement*) arg;
+  bind_to_cpus(placement->pool->m_topology.cpus(placement->node));
+  placement->pool->create_lanes(placement->node, placement->capacity);
+  return NULL;
+}
+
+// The lanes are the memory a node's workers hit hardest. With numa_aware a
+// short-lived thread on the node's CPUs allocates them and writes every
+// cell, so first-touch puts their pages on that node rather than on the
+// constructing thread's. If that thread cannot be started the lanes are
+// simply allocated here.
+void ThreadPool::allocate_lanes(int node, size_t capacity)
+{
+  if (m_numa_aware) {
+    LanePlacement placement = { this, node, capacity };
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, place_lanes, &placement) == 0) {
+      pthread_join(tid, NULL);
+      return;
+    }
+  }
+  create_lanes(node, capacity);
+}
+
+void ThreadPool::create_lanes(int node, size_t capacity)
+{
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    m_lanes[node * NUM_PRIORITIES + i] = new Lane(capacity);
+  }
+}
+
+// Runs on the worker itself before its first task, so the memory its tasks
+// first touch lands on its node; the node's lanes are already there.
+void ThreadPool::bind_worker(int index)
+{
+  const Worker& worker = m_workers[index];
+  if (worker.cpu >= 0) {
+    bind_to_cpus(std::vector<int>(1, worker.cpu));
+  } else if (m_numa_aware) {
+    bind_to_cpus(m_topology.cpus(worker.node));
+  }
+}
+
+// Absolute CLOCK_REALTIME time ms milliseconds from now, for timed waits
+static void deadline_after(int ms, struct timespec* deadline)
+{
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (long) (ms % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
 }
 
 // We can't pass a member function to pthread_create.
@@ -45,106 +289,728 @@ ThreadPool::~ThreadPool()
 extern "C"
 void* start_thread(void* arg)
 {
-  ThreadPool* tp = (ThreadPool*) arg;
-  tp->execute_thread();
+  ThreadPool::Worker* worker = (ThreadPool::Worker*) arg;
+  worker->pool->execute_thread(worker->index);
   return NULL;
 }
 
 int ThreadPool::initialize_threadpool()
 {
-  // TODO: COnsider lazy loading threads instead of creating all at once
+  if (m_scheduling_mode == WORK_STEALING) {
+    // deques must exist before any worker (or submitter) can touch them,
+    // including the ones for workers that are only spawned later on
+    for (int i = 0; i < m_pool_size; i++) {
+      m_local_tasks.push_back(new WorkStealingDeque<Task>());
+    }
+  }
   m_pool_state = STARTED;
-  int ret = -1;
-  for (int i = 0; i < m_pool_size; i++) {
-    pthread_t tid;
-    ret = pthread_create(&tid, NULL, start_thread, (void*) this);
-    if (ret != 0) {
-      cerr << "pthread_create() failed: " << ret << endl;
+
+  // Only the minimum is started now, the rest are spawned on demand.
+  for (int i = 0; i < m_min_threads; i++) {
+    if (spawn_worker() != 0) {
       return -1;
     }
-    m_threads.push_back(tid);
   }
-  cout << m_pool_size << " threads created by the thread pool" << endl;
+  // with min_threads 0, tasks queued before now still need a worker
+  maybe_spawn_worker();
 
   return 0;
 }
 
+// Starts one more worker in a free slot. Fails if the pool is stopped or
+// already at max_threads.
+int ThreadPool::spawn_worker()
+{
+  m_thread_mutex.lock();
+  join_retired_workers();
+
+  int index = -1;
+  for (int i = 0; i < m_pool_size; i++) {
+    if (!m_workers[i].active) {
+      index = i;
+      break;
+    }
+  }
+  if (m_pool_state == STOPPED || index < 0) {
+    m_thread_mutex.unlock();
+    return -1;
+  }
+
+  int ret = pthread_create(&m_workers[index].tid, NULL, start_thread,
+                           (void*) &m_workers[index]);
+  if (ret != 0) {
+    cerr << "pthread_create() failed: " << ret << endl;
+    m_thread_mutex.unlock();
+    return -1;
+  }
+  m_workers[index].active = true;
+  int count = m_thread_count.fetch_add(1) + 1;
+  int peak = m_peak_thread_count.load();
+  while (count > peak && !m_peak_thread_count.compare_exchange_weak(peak, count)) {
+  }
+  m_thread_mutex.unlock();
+  return 0;
+}
+
+// Called after every submission to and every take from the global queue,
+// so a backlog is noticed both when it builds up and while it persists
+// after a burst. The common cases (pool
+// already at its maximum, a worker idle, or a short queue) are a few relaxed
+// loads and never touch m_thread_mutex. A pool with min_threads 0 that has
+// no worker left gets one for its first queued task, whatever the depth.
+void ThreadPool::maybe_spawn_worker()
+{
+  int count = m_thread_count.load();
+  if (count >= m_pool_size) {
+    return;
+  }
+  if (count == 0) {
+    if (queued_task_count() == 0) {
+      return;
+    }
+  } else if (m_idle_workers.load(memory_order_relaxed) > 0 ||
+             queued_task_count() < m_spawn_queue_depth) {
+    return;
+  }
+  spawn_worker();
+}
+
+// A parked worker above min_threads gives up its slot. Only the owner pushes
+// to its deque, so if the deque is empty now nothing can be lost with it.
+bool ThreadPool::try_retire(int index)
+{
+  if (!m_local_tasks.empty() && !m_local_tasks[index]->empty()) {
+    return false;
+  }
+  int count = m_thread_count.load();
+  while (count > m_min_threads) {
+    if (m_thread_count.compare_exchange_weak(count, count - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::retire_worker(int index)
+{
+  m_thread_mutex.lock();
+  // Once the pool is stopping destroy_threadpool() joins every active
+  // worker, so only hand ourselves over for a later join before that.
+  if (m_pool_state != STOPPED) {
+    m_workers[index].active = false;
+    m_retired_threads.push_back(m_workers[index].tid);
+  }
+  m_thread_mutex.unlock();
+}
+
+// Must be called with m_thread_mutex held.
+void ThreadPool::join_retired_workers()
+{
+  for (size_t i = 0; i < m_retired_threads.size(); i++) {
+    pthread_join(m_retired_threads[i], NULL);
+  }
+  m_retired_threads.clear();
+}
+
 int ThreadPool::destroy_threadpool()
 {
+  return shutdown(SHUTDOWN_DISCARD);
+}
+
+// Stops the pool and returns how many queued tasks were discarded.
+// New submissions from outside the pool are refused from here on. With
+// SHUTDOWN_DRAIN the workers first finish every queued task, including
+// whatever those tasks queue in turn; if that takes longer than timeout_ms
+// (-1: no limit) the rest is discarded as with SHUTDOWN_DISCARD. Then
+// shutdown_token() is cancelled and every worker is joined as soon as its
+// current task returns, so the stop itself takes as long as the longest
+// running task (less if tasks poll the token). Discarded tasks are destroyed
+// without running, their futures fail with BrokenPromise.
+int ThreadPool::shutdown(int mode, int timeout_ms)
+{
+  m_accepting = false;
+  if (mode == SHUTDOWN_DRAIN && m_pool_state == STARTED) {
+    drain(timeout_ms);
+  }
+
   // Note: this is not for synchronization, its for thread communication!
-  // destroy_threadpool() will only be called from the main thread, yet
-  // the modified m_pool_state may not show up to other threads until its 
-  // modified in a lock!
+  // A worker about to park checks m_pool_state under m_task_mutex, so
+  // setting it under the lock guarantees the broadcast below reaches it.
   m_task_mutex.lock();
   m_pool_state = STOPPED;
   m_task_mutex.unlock();
-  cout << "Broadcasting STOP signal to all threads..." << endl;
-  m_task_cond_var.broadcast(); // notify all threads we are shttung down
+  m_shutdown_source.cancel();
+  m_task_cond_var.broadcast(); // notify all threads we are shutting down
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    // producers blocked on a full lane give up
+    m_lanes[i]->space_mutex.lock();
+    m_lanes[i]->space_cond_var.broadcast();
+    m_lanes[i]->space_mutex.unlock();
+  }
 
-  int ret = -1;
+  // No worker can be spawned or retire itself any more. Collect everybody,
+  // joining outside m_thread_mutex: a worker that timed out just before the
+  // stop still takes that lock in retire_worker() on its way out.
+  std::vector<pthread_t> threads;
+  m_thread_mutex.lock();
+  join_retired_workers();
   for (int i = 0; i < m_pool_size; i++) {
-    void* result;
-    ret = pthread_join(m_threads[i], &result);
-    cout << "pthread_join() returned " << ret << ": " << strerror(errno) << endl;
-    m_task_cond_var.broadcast(); // try waking up a bunch of threads that are still waiting
+    if (m_workers[i].active) {
+      threads.push_back(m_workers[i].tid);
+      m_workers[i].active = false;
+    }
   }
-  cout << m_pool_size << " threads exited from the thread pool" << endl;
-  return 0;
+  m_thread_mutex.unlock();
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    int ret = pthread_join(threads[i], NULL);
+    if (ret != 0) {
+      cerr << "pthread_join() failed: " << strerror(ret) << endl;
+    }
+  }
+  m_thread_count = 0;
+
+  int discarded = discard_queued_tasks();
+  for (size_t i = 0; i < m_local_tasks.size(); i++) {
+    delete m_local_tasks[i];
+  }
+  m_local_tasks.clear();
+  return discarded;
 }
 
-void* ThreadPool::execute_thread()
+// Waits until every worker is parked with nothing left to run. Returns
+// false if timeout_ms passed first.
+bool ThreadPool::drain(int timeout_ms)
 {
-  Task* task = NULL;
-  cout << "Starting thread " << pthread_self() << endl;
-  while(true) {
-    // Try to pick a task
-    cout << "Locking: " << pthread_self() << endl;
-    m_task_mutex.lock();
-    
-    // We need to put pthread_cond_wait in a loop for two reasons:
-    // 1. There can be spurious wakeups (due to signal/ENITR)
-    // 2. When mutex is released for waiting, another thread can be waken up
-    //    from a signal/broadcast and that thread can mess up the condition.
-    //    So when the current thread wakes up the condition may no longer be
-    //    actually true!
-    while ((m_pool_state != STOPPED) && (m_tasks.empty())) {
-      // Wait until there is a task in the queue
-      // Unlock mutex while wait, then lock it back when signaled
-      cout << "Unlocking and waiting: " << pthread_self() << endl;
-      m_task_cond_var.wait(m_task_mutex.get_mutex_ptr());
-      cout << "Signaled and locking: " << pthread_self() << endl;
-    }
+  long give_up = monotonic_ns() + timeout_ms * 1000000L;
 
-    // If the thread was woken up to notify process shutdown, return from here
-    if (m_pool_state == STOPPED) {
-      cout << "Unlocking and exiting: " << pthread_self() << endl;
+  m_task_mutex.lock();
+  m_draining = true;
+  bool drained;
+  while (!(drained = is_drained())) {
+    if (timeout_ms >= 0 && monotonic_ns() >= give_up) {
+      break;
+    }
+    if (m_thread_count.load() == 0) {
+      // min_threads may be 0, somebody has to run what is left
       m_task_mutex.unlock();
-      pthread_exit(NULL);
+      spawn_worker();
+      m_task_mutex.lock();
+      continue;
     }
+    struct timespec deadline;
+    deadline_after(DRAIN_POLL_MS, &deadline);
+    m_drain_cond_var.timed_wait(m_task_mutex.get_mutex_ptr(), &deadline);
+  }
+  m_draining = false;
+  m_task_mutex.unlock();
+  return drained;
+}
 
-    task = m_tasks.front();
-    m_tasks.pop_front();
-    cout << "Unlocking: " << pthread_self() << endl;
-    m_task_mutex.unlock();
+// A worker that is parked is not running anything, so once all of them are
+// parked and nothing is queued no more work can appear from inside the pool.
+bool ThreadPool::is_drained()
+{
+  return m_idle_workers.load() == m_thread_count.load() && !has_pending_tasks();
+}
+
+// Only called once every worker has been joined
+int ThreadPool::discard_queued_tasks()
+{
+  int discarded = 0;
+  while (true) {
+    Task task;
+    bool found = false;
+    for (size_t i = 0; i < m_lanes.size() && !found; i++) {
+      found = m_lanes[i]->tasks.try_dequeue(task);
+    }
+    for (size_t i = 0; i < m_local_tasks.size() && !found; i++) {
+      found = m_local_tasks[i]->pop(task);
+    }
+    if (!found) {
+      break;
+    }
+    discarded++;
+    // task is destroyed here: a PromiseGuard inside fails its future, whose
+    // continuations may even try to submit more (and are refused)
+  }
+  m_discarded_tasks.fetch_add(discarded, memory_order_relaxed);
+  return discarded;
+}
+
+bool ThreadPool::refuses()
+{
+  return !m_accepting.load(memory_order_relaxed) && t_current_pool != this;
+}
 
-    //cout << "Executing thread " << pthread_self() << endl;
-    // execute the task
-    (*task)(); // could also do task->run(arg);
-    //cout << "Done executing thread " << pthread_self() << endl;
+void* ThreadPool::execute_thread(int index)
+{
+  bind_worker(index);
+  t_current_pool = this;
+  t_worker_index = index;
+
+  Task task;
+  while (wait_for_task(index, task)) {
+    TRACE_EVENT(TRACE_TASK_START, 0);
+    task(); // could also do task.run();
+    TRACE_EVENT(TRACE_TASK_END, 0);
   }
+  if (m_pool_state != STOPPED) {
+    retire_worker(index); // idle timeout, not shutdown
+  }
+
+  t_current_pool = NULL;
+  t_worker_index = -1;
   return NULL;
 }
 
-int ThreadPool::add_task(Task* task)
+// Adaptive wait: a worker that just finished a task is likely to find the
+// next one within a few hundred cycles, so spin first, then give the core
+// away with sched_yield(), and only park on the condition variable (a futex
+// syscall) when the pool has really gone quiet. Returns false on shutdown
+// or when the worker should retire.
+bool ThreadPool::wait_for_task(int index, Task& task)
 {
-  m_task_mutex.lock();
+  int spins = 0;
+  while (m_pool_state != STOPPED) {
+    if (find_task(index, task)) {
+      return true;
+    }
 
-  // TODO: put a limit on how many tasks can be added at most
-  m_tasks.push_back(task);
+    if (spins < SPIN_ITERATIONS) {
+      cpu_relax();
+    } else if (spins < SPIN_ITERATIONS + YIELD_ITERATIONS) {
+      sched_yield();
+    } else {
+      if (!park_worker(index)) {
+        return false;
+      }
+      spins = 0;
+      continue;
+    }
+    spins++;
+  }
+  return false;
+}
 
-  m_task_cond_var.signal(); // wake up one thread that is waiting for a task to be available
+// Returns false if the worker stayed idle for idle_timeout_ms and may retire.
+bool ThreadPool::park_worker(int index)
+{
+  bool retire = false;
+  m_task_mutex.lock();
+  m_idle_workers.fetch_add(1);
+  // pairs with the fence in add_task(): either the submitter sees us idle
+  // and signals, or we see its task in has_pending_tasks()
+  atomic_thread_fence(memory_order_seq_cst);
+  if (m_draining) {
+    m_drain_cond_var.signal(); // maybe we were the last one busy
+  }
+
+  // We need to put pthread_cond_wait in a loop for two reasons:
+  // 1. There can be spurious wakeups (due to signal/ENITR)
+  // 2. When mutex is released for waiting, another thread can be waken up
+  //    from a signal/broadcast and that thread can mess up the condition.
+  //    So when the current thread wakes up the condition may no longer be
+  //    actually true!
+  struct timespec deadline;
+  deadline_after(m_idle_timeout_ms, &deadline);
+  TRACE_EVENT(TRACE_PARK, 0);
 
+  while ((m_pool_state != STOPPED) && !has_pending_tasks()) {
+    if (m_thread_count.load() <= m_min_threads) {
+      m_task_cond_var.wait(m_task_mutex.get_mutex_ptr());
+    } else if (!m_task_cond_var.timed_wait(m_task_mutex.get_mutex_ptr(), &deadline)) {
+      if (!has_pending_tasks() && try_retire(index)) {
+        retire = true;
+        break;
+      }
+    }
+  }
+  m_idle_workers.fetch_sub(1);
   m_task_mutex.unlock();
+  TRACE_EVENT(TRACE_UNPARK, 0);
+  return !retire;
+}
 
-  return 0;
+// In work-stealing mode: the node's high priority lane, then own deque
+// (LIFO, cache-hot), then the rest of the global queue that external
+// submitters feed, then try to steal from the other workers (FIFO), the
+// ones on the same node first.
+bool ThreadPool::find_task(int index, Task& task)
+{
+  int node = (index >= 0) ? m_workers[index].node : calling_node();
+  if (m_scheduling_mode == WORK_STEALING && index >= 0) {
+    if (!m_lanes[lane_for(PRIORITY_HIGH, node)]->tasks.empty() &&
+        dequeue_global(node, index, task)) {
+      return true;
+    }
+    if (m_local_tasks[index]->pop(task)) {
+      TRACE_EVENT(TRACE_DEQUEUE, -1);
+      return true;
+    }
+  }
+
+  if (dequeue_global(node, index, task)) {
+    // a backlog that outlives the burst that created it means the current
+    // workers are not keeping up
+    maybe_spawn_worker();
+    return true;
+  }
+
+  if (m_scheduling_mode == WORK_STEALING) {
+    // index is -1 for threads outside the pool, they may steal from anyone
+    for (int pass = 0; pass < (m_node_count > 1 ? 2 : 1); pass++) {
+      for (int i = 1; i <= m_pool_size; i++) {
+        int victim = (index + i) % m_pool_size;
+        if (victim == index || (m_workers[victim].node == node) != (pass == 0)) {
+          continue;
+        }
+        if (m_local_tasks[victim]->steal(task)) {
+          TRACE_EVENT(TRACE_STEAL, victim);
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+// Takes from the most urgent non-empty lane of node, then of the other
+// nodes. Every m_aging_interval-th take of a thread starts with one of the
+// lower lanes instead (each in turn) and then goes on from the top, so with
+// a steady stream of high priority work every lane still gets at least 1 in
+// (m_aging_interval * lanes below the top) of the takes.
+bool ThreadPool::dequeue_global(int node, int index, Task& task)
+{
+  int first = 0;
+  unsigned long takes = ++t_global_takes;
+  if (m_aging_interval > 0 && takes % m_aging_interval == 0) {
+    first = 1 + (takes / m_aging_interval) % (NUM_PRIORITIES - 1);
+  }
+
+  for (int n = 0; n < m_node_count; n++) {
+    int base = ((node + n) % m_node_count) * NUM_PRIORITIES;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+      // first, then 0, 1, ... skipping first
+      int lane = base + ((i == 0) ? first : (i <= first ? i - 1 : i));
+      if (m_lanes[lane]->tasks.try_dequeue(task)) {
+        TRACE_EVENT(TRACE_DEQUEUE, lane);
+        if (m_track_wait_times) {
+          record_wait(index, lane % NUM_PRIORITIES, task);
+        }
+        if (m_overflow_policy == OVERFLOW_BLOCK) {
+          wake_blocked_producer(lane);
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Each worker only writes its own WaitStats slot, so these atomics are never
+// contended; threads outside the pool share the last slot. lane is the
+// priority here, wait times are not kept per node.
+void ThreadPool::record_wait(int index, int lane, const Task& task)
+{
+  long wait = monotonic_ns() - task.enqueue_time();
+  WaitStats& stats = m_wait_stats[index >= 0 ? index : m_pool_size];
+  stats.dequeued[lane].fetch_add(1, memory_order_relaxed);
+  stats.total_wait_ns[lane].fetch_add(wait, memory_order_relaxed);
+  long max = stats.max_wait_ns[lane].load(memory_order_relaxed);
+  while (wait > max &&
+         !stats.max_wait_ns[lane].compare_exchange_weak(max, wait, memory_order_relaxed)) {
+  }
+}
+
+LaneStats ThreadPool::get_lane_stats(int priority) const
+{
+  int lane = clamp_priority(priority);
+  LaneStats result;
+  result.depth = 0;
+  for (int node = 0; node < m_node_count; node++) {
+    result.depth += m_lanes[node * NUM_PRIORITIES + lane]->tasks.size();
+  }
+  result.dequeued = 0;
+  result.total_wait_ns = 0;
+  result.max_wait_ns = 0;
+  for (int i = 0; i <= m_pool_size; i++) {
+    const WaitStats& stats = m_wait_stats[i];
+    result.dequeued += stats.dequeued[lane].load(memory_order_relaxed);
+    result.total_wait_ns += stats.total_wait_ns[lane].load(memory_order_relaxed);
+    long max = stats.max_wait_ns[lane].load(memory_order_relaxed);
+    if (max > result.max_wait_ns) {
+      result.max_wait_ns = max;
+    }
+  }
+  return result;
+}
+
+size_t ThreadPool::get_node_queue_depth(int node) const
+{
+  size_t depth = 0;
+  for (int i = 0; i < NUM_PRIORITIES; i++) {
+    depth += m_lanes[node * NUM_PRIORITIES + i]->tasks.size();
+  }
+  return depth;
+}
+
+bool ThreadPool::has_pending_tasks()
+{
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    if (!m_lanes[i]->tasks.empty()) {
+      return true;
+    }
+  }
+  for (size_t i = 0; i < m_local_tasks.size(); i++) {
+    if (!m_local_tasks[i]->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t ThreadPool::queued_task_count()
+{
+  size_t count = 0;
+  for (size_t i = 0; i < m_lanes.size(); i++) {
+    count += m_lanes[i]->tasks.size();
+  }
+  return count;
+}
+
+void ThreadPool::wake_idle_worker()
+{
+  // Busy pools never get here with idle workers, so they never pay for the
+  // lock or the futex wake.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (m_idle_workers.load(memory_order_relaxed) > 0) {
+    // taking the lock guarantees the idle worker is already waiting
+    m_task_mutex.lock();
+    m_task_cond_var.signal();
+    m_task_mutex.unlock();
+  }
+}
+
+void ThreadPool::wake_idle_workers(size_t count)
+{
+  if (count == 0) {
+    return;
+  }
+  atomic_thread_fence(memory_order_seq_cst);
+  int idle = m_idle_workers.load(memory_order_relaxed);
+  if (idle > 0) {
+    m_task_mutex.lock();
+    if (count >= (size_t) idle) {
+      m_task_cond_var.broadcast();
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        m_task_cond_var.signal();
+      }
+    }
+    m_task_mutex.unlock();
+  }
+}
+
+// A lane of the global queue is full: applies the overflow policy to task.
+// Returns TASK_QUEUED once the task made it into the lane, TASK_RAN_ON_CALLER
+// if it was run right here, or a negative status if it was refused (the task
+// is left untouched then). OVERFLOW_DROP_OLDEST drops the oldest task of
+// the same lane, never one of a different priority.
+int ThreadPool::enqueue_on_overflow(Task& task, int lane)
+{
+  MPMCQueue<Task>& tasks = m_lanes[lane]->tasks;
+  struct timespec deadline;
+  struct timespec* timeout = NULL;
+  if (m_block_timeout_ms >= 0) {
+    deadline_after(m_block_timeout_ms, &deadline);
+    timeout = &deadline;
+  }
+
+  while (!tasks.try_enqueue(std::move(task))) {
+    if (refuses()) {
+      // shut down while we were waiting for room
+      m_rejected_tasks.fetch_add(1, memory_order_relaxed);
+      return TASK_REJECTED;
+    }
+    if (m_overflow_policy == OVERFLOW_FAIL) {
+      m_rejected_tasks.fetch_add(1, memory_order_relaxed);
+      return TASK_REJECTED;
+    } else if (m_overflow_policy == OVERFLOW_CALLER_RUNS) {
+      task();
+      return TASK_RAN_ON_CALLER;
+    } else if (m_overflow_policy == OVERFLOW_DROP_OLDEST) {
+      Task oldest;
+      if (tasks.try_dequeue(oldest)) {
+        m_dropped_tasks.fetch_add(1, memory_order_relaxed);
+      }
+    } else if (!wait_for_space(timeout, lane)) {
+      m_rejected_tasks.fetch_add(1, memory_order_relaxed);
+      return TASK_TIMED_OUT;
+    }
+  }
+  return TASK_QUEUED;
+}
+
+// Blocks until the lane has room again or deadline (NULL: never) passes;
+// returns false on timeout. A worker must not block here: if every worker
+// was blocked submitting, nobody would be left to make room, so workers
+// help draining the queue instead.
+bool ThreadPool::wait_for_space(const struct timespec* deadline, int lane)
+{
+  Lane& target = *m_lanes[lane];
+  if (t_current_pool == this) {
+    if (!run_pending_task()) {
+      sched_yield();
+    }
+  } else {
+    for (int i = 0; i < YIELD_ITERATIONS; i++) {
+      if (target.tasks.size() < target.tasks.capacity()) {
+        return true;
+      }
+      sched_yield();
+    }
+
+    target.space_mutex.lock();
+    target.blocked_producers.fetch_add(1);
+    // pairs with the fence in wake_blocked_producer()
+    atomic_thread_fence(memory_order_seq_cst);
+    while (target.tasks.size() >= target.tasks.capacity() && m_pool_state != STOPPED) {
+      if (deadline == NULL) {
+        target.space_cond_var.wait(target.space_mutex.get_mutex_ptr());
+      } else if (!target.space_cond_var.timed_wait(target.space_mutex.get_mutex_ptr(), deadline)) {
+        break;
+      }
+    }
+    target.blocked_producers.fetch_sub(1);
+    target.space_mutex.unlock();
+  }
+
+  if (deadline != NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > deadline->tv_sec ||
+        (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+      return target.tasks.size() < target.tasks.capacity();
+    }
+  }
+  return true;
+}
+
+void ThreadPool::wake_blocked_producer(int lane)
+{
+  Lane& target = *m_lanes[lane];
+  atomic_thread_fence(memory_order_seq_cst);
+  if (target.blocked_producers.load(memory_order_relaxed) > 0) {
+    target.space_mutex.lock();
+    target.space_cond_var.signal();
+    target.space_mutex.unlock();
+  }
+}
+
+// Out of range priorities are clamped to the nearest lane
+int ThreadPool::clamp_priority(int priority)
+{
+  if (priority < PRIORITY_HIGH) {
+    return PRIORITY_HIGH;
+  }
+  if (priority >= NUM_PRIORITIES) {
+    return NUM_PRIORITIES - 1;
+  }
+  return priority;
+}
+
+// Index into m_lanes. Node hints the pool does not have (including
+// ANY_NODE) fall back to the submitter's own node.
+int ThreadPool::lane_for(int priority, int node)
+{
+  if (node < 0 || node >= m_node_count) {
+    node = calling_node();
+  }
+  return node * NUM_PRIORITIES + clamp_priority(priority);
+}
+
+int ThreadPool::calling_node()
+{
+  if (!m_numa_aware) {
+    return 0;
+  }
+  if (t_current_pool == this) {
+    return m_workers[t_worker_index].node;
+  }
+  return m_topology.node_of_cpu(sched_getcpu());
+}
+
+// Normal priority tasks spawned by one of our own workers stay on that
+// worker's deque unless they are meant for another node; the other
+// priorities need the global lanes to be honoured.
+bool ThreadPool::stays_local(int priority, int node)
+{
+  return m_scheduling_mode == WORK_STEALING && t_current_pool == this &&
+         clamp_priority(priority) == PRIORITY_NORMAL &&
+         (node < 0 || node >= m_node_count || node == m_workers[t_worker_index].node);
+}
+
+ThreadPool* ThreadPool::current_pool()
+{
+  return t_current_pool;
+}
+
+int ThreadPool::current_worker_index()
+{
+  return t_worker_index;
+}
+
+// Runs one queued task on the calling thread, if there is one. Used by
+// threads that wait for pool work to finish so they help instead of block.
+bool ThreadPool::run_pending_task()
+{
+  int index = (t_current_pool == this) ? t_worker_index : -1;
+  Task task;
+  if (!find_task(index, task)) {
+    return false;
+  }
+  TRACE_EVENT(TRACE_TASK_START, 0);
+  task();
+  TRACE_EVENT(TRACE_TASK_END, 0);
+  return true;
+}
+
+int ThreadPool::add_tasks(Task* tasks, size_t count, int priority, int node)
+{
+  return add_tasks(tasks, tasks + count, priority, node);
+}
+
+int ThreadPool::add_task(Task task, int priority, int node)
+{
+  if (refuses()) {
+    m_rejected_tasks.fetch_add(1, memory_order_relaxed);
+    return TASK_REJECTED;
+  }
+
+  int lane = lane_for(priority, node);
+  if (stays_local(priority, node)) {
+    if (m_local_tasks[t_worker_index]->push(std::move(task))) {
+      TRACE_EVENT(TRACE_ENQUEUE, 1);
+      wake_idle_worker();
+      return TASK_QUEUED;
+    }
+    // local deque is full, spill over to the global queue
+  }
+
+  if (m_track_wait_times) {
+    task.set_enqueue_time(monotonic_ns());
+  }
+  int ret = TASK_QUEUED;
+  if (!m_lanes[lane]->tasks.try_enqueue(std::move(task))) {
+    ret = enqueue_on_overflow(task, lane);
+    if (ret != TASK_QUEUED) {
+      return ret;
+    }
+  }
+  TRACE_EVENT(TRACE_ENQUEUE, 1);
+  wake_idle_worker();
+  maybe_spawn_worker();
+
+  return TASK_QUEUED;
 }
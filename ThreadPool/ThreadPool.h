@@ -1,18 +1,80 @@
 #ifndef _H_THREADPOOL
 #define _H_THREADPOOL
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
 
-#include <deque>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "Cancellation.h"
+#include "MPMCQueue.h"
+#include "Platform.h"
+#include "Topology.h"
+#include "Trace.h"
+#include "WorkStealingDeque.h"
+
 using namespace std;
 
 const int DEFAULT_POOL_SIZE = 10;
 const int STARTED = 0;
 const int STOPPED = 1;
 
+// How shutdown() treats tasks that are still queued
+const int SHUTDOWN_DISCARD = 0; // drop them, only running tasks finish
+const int SHUTDOWN_DRAIN = 1;   // run them all first
+
+// Scheduling modes
+const int GLOBAL_FIFO = 0;   // all workers share one FIFO queue
+const int WORK_STEALING = 1; // every worker owns a deque, idle workers steal
+
+// Elastic sizing defaults, see ThreadPoolOptions
+const int DEFAULT_MIN_THREADS = 1;
+const int DEFAULT_IDLE_TIMEOUT_MS = 10000;
+const int DEFAULT_SPAWN_QUEUE_DEPTH = 4;
+
+// What add_task() does when the global queue is full
+const int OVERFLOW_BLOCK = 0;       // wait for room, up to block_timeout_ms
+const int OVERFLOW_FAIL = 1;        // give up right away with TASK_REJECTED
+const int OVERFLOW_DROP_OLDEST = 2; // discard the oldest queued task
+const int OVERFLOW_CALLER_RUNS = 3; // run the task on the submitting thread
+
+// add_task() status codes, negative means the task was not accepted
+const int TASK_QUEUED = 0;
+const int TASK_RAN_ON_CALLER = 1;
+const int TASK_REJECTED = -1;
+const int TASK_TIMED_OUT = -2;
+
+// Priority lanes of the global queue, lower value is more urgent
+const int PRIORITY_HIGH = 0;
+const int PRIORITY_NORMAL = 1;
+const int PRIORITY_LOW = 2;
+const int NUM_PRIORITIES = 3;
+
+// Node hint meaning "wherever the submitter runs"
+const int ANY_NODE = -1;
+
+// Every AGING_INTERVAL-th take from the global queue serves a lower lane
+// first, so low priority work still moves under a flood of urgent work
+const int DEFAULT_AGING_INTERVAL = 8;
+
+// How long an idle worker busy-waits before it parks on the condition variable
+const int SPIN_ITERATIONS = 128;
+const int YIELD_ITERATIONS = 16;
+
+// Callables up to this size are stored inside the Task itself, bigger ones
+// go to the heap. 48 bytes keeps sizeof(Task) at one cache line.
+const int TASK_INLINE_SIZE = 48;
+
 class Mutex
 {
 public:
@@ -23,8 +85,7 @@ public:
   }
   ~Mutex()
   {
-    while(is_locked);
-    unlock(); // Unlock Mutex after shared resource is safe
+    while(is_locked); // wait until the shared resource is safe
     pthread_mutex_destroy(&m_lock);
   }
   void lock()
@@ -52,8 +113,511 @@ public:
   CondVar() { pthread_cond_init(&m_cond_var, NULL); }
   ~CondVar() { pthread_cond_destroy(&m_cond_var); }
   void wait(pthread_mutex_t* mutex) {pthread_cond_wait(&m_cond_var, mutex); }
+  // returns false if abstime (CLOCK_REALTIME) passed without a signal
+  bool timed_wait(pthread_mutex_t* mutex, const struct timespec* abstime)
+  {
+    return pthread_cond_timedwait(&m_cond_var, mutex, abstime) != ETIMEDOUT;
+  }
   void signal() { pthread_cond_signal(&m_cond_var); }
   void broadcast() { pthread_cond_broadcast(&m_cond_var); }
 private:
   pthread_cond_t m_cond_var;
 };
+
+template <typename T> class Future;
+class ScheduleAwaitable;
+
+// Result type of calling fn(args...)
+template <typename Function, typename... Args>
+struct TaskResult
+{
+  typedef decltype(declval<Function&>()(declval<Args>()...)) type;
+};
+
+// A move-only, type-erased unit of work. Any callable taking no arguments
+// (free function + argument, lambda with captures, functor) can be wrapped;
+// if it fits in TASK_INLINE_SIZE bytes it is stored inline, so creating and
+// queueing a Task does not allocate.
+class Task
+{
+public:
+  Task();
+  Task(void (*fn_ptr)(void*), void* arg); // pass a free function pointer
+  template <typename Function,
+            typename = typename enable_if<
+              !is_same<typename decay<Function>::type, Task>::value>::type>
+  Task(Function&& fn);                    // or any callable, e.g. a lambda
+  Task(Task&& other) noexcept;
+  Task& operator=(Task&& other) noexcept;
+  ~Task();
+  void operator()();
+  void run();
+  bool empty() const { return m_ops == NULL; }
+  // monotonic_ns() when the pool queued it, for wait time metrics
+  long enqueue_time() const { return m_enqueue_time; }
+  void set_enqueue_time(long ns) { m_enqueue_time = ns; }
+private:
+  Task(const Task&);
+  Task& operator=(const Task&);
+
+  struct Ops
+  {
+    void (*invoke)(void* storage);
+    void (*move)(void* dst, void* src); // move-construct dst, destroy src
+    void (*destroy)(void* storage);
+  };
+  template <typename F> struct InlineOps;
+  template <typename F> struct HeapOps;
+
+  template <typename F, typename Function>
+  void construct(Function&& fn, true_type /* fits inline */);
+  template <typename F, typename Function>
+  void construct(Function&& fn, false_type);
+  void reset();
+
+  alignas(max_align_t) unsigned char m_storage[TASK_INLINE_SIZE];
+  const Ops* m_ops; // NULL for an empty Task
+  long m_enqueue_time;
+};
+
+template <typename F>
+struct Task::InlineOps
+{
+  static void invoke(void* storage) { (*static_cast<F*>(storage))(); }
+  static void move(void* dst, void* src)
+  {
+    new (dst) F(std::move(*static_cast<F*>(src)));
+    static_cast<F*>(src)->~F();
+  }
+  static void destroy(void* storage) { static_cast<F*>(storage)->~F(); }
+  static const Ops ops;
+};
+
+template <typename F>
+const Task::Ops Task::InlineOps<F>::ops = { &invoke, &move, &destroy };
+
+template <typename F>
+struct Task::HeapOps
+{
+  static void invoke(void* storage) { (**static_cast<F**>(storage))(); }
+  static void move(void* dst, void* src)
+  {
+    *static_cast<F**>(dst) = *static_cast<F**>(src);
+  }
+  static void destroy(void* storage) { delete *static_cast<F**>(storage); }
+  static const Ops ops;
+};
+
+template <typename F>
+const Task::Ops Task::HeapOps<F>::ops = { &invoke, &move, &destroy };
+
+template <typename Function, typename>
+Task::Task(Function&& fn) : m_enqueue_time(0)
+{
+  typedef typename decay<Function>::type F;
+  construct<F>(std::forward<Function>(fn),
+               integral_constant<bool,
+                 sizeof(F) <= TASK_INLINE_SIZE &&
+                 alignof(F) <= alignof(max_align_t) &&
+                 is_nothrow_move_constructible<F>::value>());
+}
+
+template <typename F, typename Function>
+void Task::construct(Function&& fn, true_type)
+{
+  new (m_storage) F(std::forward<Function>(fn));
+  m_ops = &InlineOps<F>::ops;
+}
+
+template <typename F, typename Function>
+void Task::construct(Function&& fn, false_type)
+{
+  *reinterpret_cast<F**>(m_storage) = new F(std::forward<Function>(fn));
+  m_ops = &HeapOps<F>::ops;
+}
+
+extern "C" void* start_thread(void* arg);
+extern "C" void* place_lanes(void* arg);
+
+// Tuning knobs for a ThreadPool. min_threads workers are started by
+// initialize_threadpool() and stay for the life of the pool. More workers,
+// up to max_threads, are spawned when at least spawn_queue_depth tasks are
+// waiting in the global queue and no worker is idle; those extra workers
+// exit again after idle_timeout_ms without work. With min_threads 0 the
+// first queued task always gets a worker, however short the queue.
+// The global queue has NUM_PRIORITIES lanes of queue_capacity tasks each
+// (rounded up to a power of two); overflow_policy decides what happens to
+// submissions beyond that. block_timeout_ms only applies to OVERFLOW_BLOCK,
+// -1 waits forever. Workers take from the most urgent non-empty lane, except
+// that every aging_interval-th take (0 disables aging) starts with one of
+// the lower lanes in turn. track_wait_times timestamps every queued task so
+// get_lane_stats() can report how long tasks waited; it costs two clock
+// reads per task and is off by default.
+// pin_threads binds every worker to one CPU. numa_aware groups the workers
+// into one sub-pool per NUMA node: each worker stays on its node's CPUs and
+// every node has its own set of lanes, allocated and first touched by a
+// thread on that node, which its workers serve first and the other nodes'
+// workers only when they run dry. topology_file replaces the
+// sysfs topology with a fake one, see CpuTopology.
+struct ThreadPoolOptions
+{
+  ThreadPoolOptions();
+  int min_threads;
+  int max_threads;
+  int idle_timeout_ms;
+  int spawn_queue_depth;
+  int scheduling_mode;
+  int queue_capacity;
+  int overflow_policy;
+  int block_timeout_ms;
+  int aging_interval;
+  bool track_wait_times;
+  bool pin_threads;
+  bool numa_aware;
+  const char* topology_file; // NULL reads sysfs
+};
+
+// Snapshot of one priority lane of the global queue. The wait times are
+// only collected with ThreadPoolOptions::track_wait_times, dequeued counts
+// the tasks they cover.
+struct LaneStats
+{
+  size_t depth;       // tasks queued right now
+  long dequeued;
+  long total_wait_ns; // divide by dequeued for the mean
+  long max_wait_ns;
+};
+
+class ThreadPool
+{
+public:
+  ThreadPool();
+  ThreadPool(int pool_size, int scheduling_mode = GLOBAL_FIFO,
+             int queue_capacity = DEFAULT_QUEUE_CAPACITY); // fixed size
+  ThreadPool(const ThreadPoolOptions& options);
+  ~ThreadPool();
+  int initialize_threadpool();
+  int destroy_threadpool(); // shutdown(SHUTDOWN_DISCARD)
+  int shutdown(int mode, int timeout_ms = -1);
+  // Cancelled once the pool stops, for long tasks that want to bail out early
+  CancellationToken shutdown_token() const { return m_shutdown_source.token(); }
+  void* execute_thread(int index);
+  // node is a hint: ANY_NODE queues on the submitter's own node
+  int add_task(Task task, int priority = PRIORITY_NORMAL, int node = ANY_NODE);
+  template <typename Iter>
+  int add_tasks(Iter first, Iter last, int priority = PRIORITY_NORMAL,
+                int node = ANY_NODE); // moves the tasks out of the range
+  int add_tasks(Task* tasks, size_t count, int priority = PRIORITY_NORMAL,
+                int node = ANY_NODE);
+  template <typename Function, typename... Args>
+  Future<typename TaskResult<Function, Args...>::type>
+  submit(Function&& fn, Args&&... args);
+  template <typename Function, typename... Args>
+  Future<typename TaskResult<Function, Args...>::type>
+  submit_with_priority(int priority, Function&& fn, Args&&... args);
+  template <typename Function, typename... Args>
+  Future<typename TaskResult<Function, Args...>::type>
+  submit_on_node(int node, Function&& fn, Args&&... args);
+  template <typename Function, typename... Args>
+  Future<typename TaskResult<Function, Args...>::type>
+  submit_with_token(const CancellationToken& token, Function&& fn, Args&&... args);
+  template <typename Function>
+  void parallel_for(long begin, long end, long grain, Function fn);
+  bool run_pending_task();
+  // co_await pool.schedule() moves a coroutine onto a worker (Coroutine.h)
+  ScheduleAwaitable schedule(int priority = PRIORITY_NORMAL);
+  // The pool whose worker is the calling thread, NULL outside of any pool
+  static ThreadPool* current_pool();
+  int get_thread_count() const { return m_thread_count.load(memory_order_relaxed); }
+  int get_peak_thread_count() const { return m_peak_thread_count.load(memory_order_relaxed); }
+  size_t get_queue_capacity() const { return m_lanes[0]->tasks.capacity(); } // per lane
+  LaneStats get_lane_stats(int priority) const; // summed over all nodes
+  int get_node_count() const { return m_node_count; }
+  size_t get_node_queue_depth(int node) const;
+  const CpuTopology& get_topology() const { return m_topology; }
+  long get_rejected_task_count() const { return m_rejected_tasks.load(memory_order_relaxed); }
+  long get_dropped_task_count() const { return m_dropped_tasks.load(memory_order_relaxed); }
+  long get_discarded_task_count() const { return m_discarded_tasks.load(memory_order_relaxed); }
+private:
+  friend void* start_thread(void* arg);
+  friend void* place_lanes(void* arg);
+
+  struct Worker
+  {
+    ThreadPool* pool;
+    int index;
+    pthread_t tid;
+    bool active;
+    int node; // sub-pool, always 0 unless numa_aware
+    int cpu;  // CPU it is pinned to, -1 if not pinned to a single CPU
+  };
+
+  // One priority lane of the global queue, with its own backpressure so a
+  // producer blocked on a full low lane is not woken by urgent traffic
+  struct Lane
+  {
+    Lane(size_t capacity) : tasks(capacity), blocked_producers(0) {}
+    MPMCQueue<Task> tasks; // lock-free
+    Mutex space_mutex;     // producers blocked on a full lane park here
+    CondVar space_cond_var;
+    atomic<int> blocked_producers;
+  };
+
+  // Wait time counters of one worker (the last slot is shared by threads
+  // outside the pool), on its own cache line so workers never share one
+  struct alignas(CACHE_LINE_SIZE) WaitStats
+  {
+    atomic<long> dequeued[NUM_PRIORITIES];
+    atomic<long> total_wait_ns[NUM_PRIORITIES];
+    atomic<long> max_wait_ns[NUM_PRIORITIES];
+  };
+
+  void init(const ThreadPoolOptions& options);
+  void place_workers(const ThreadPoolOptions& options);
+  void allocate_lanes(int node, size_t capacity);
+  void create_lanes(int node, size_t capacity);
+  void bind_worker(int index);
+  template <typename Function, typename... Args>
+  Future<typename TaskResult<Function, Args...>::type>
+  submit_task(int priority, int node, Function&& fn, Args&&... args);
+  int spawn_worker();
+  void maybe_spawn_worker();
+  bool try_retire(int index);
+  void retire_worker(int index);
+  void join_retired_workers();
+  bool drain(int timeout_ms);
+  bool is_drained();
+  int discard_queued_tasks();
+  bool refuses(); // true if the calling thread may no longer submit
+  bool wait_for_task(int index, Task& task);
+  bool park_worker(int index);
+  bool find_task(int index, Task& task);
+  bool dequeue_global(int node, int index, Task& task);
+  void record_wait(int index, int lane, const Task& task);
+  bool has_pending_tasks();
+  size_t queued_task_count();
+  void wake_idle_worker();
+  void wake_idle_workers(size_t count);
+  int enqueue_on_overflow(Task& task, int lane);
+  bool wait_for_space(const struct timespec* deadline, int lane);
+  void wake_blocked_producer(int lane);
+  static int clamp_priority(int priority);
+  int lane_for(int priority, int node);
+  int calling_node();
+  bool stays_local(int priority, int node);
+  static int current_worker_index();
+
+  int m_pool_size;          // max_threads, worker indexes are below this
+  int m_min_threads;
+  int m_idle_timeout_ms;
+  size_t m_spawn_queue_depth;
+  int m_scheduling_mode;
+  Mutex m_task_mutex;       // only used to park and wake idle workers
+  CondVar m_task_cond_var;
+  // global queue, NUM_PRIORITIES lanes per node: lane node * NUM_PRIORITIES +
+  // priority
+  std::vector<Lane*> m_lanes;
+  int m_node_count;
+  bool m_numa_aware;
+  CpuTopology m_topology;
+  atomic<int> m_pool_state;
+  atomic<bool> m_accepting; // cleared by shutdown(), workers may still submit
+  bool m_draining;          // guarded by m_task_mutex
+  CondVar m_drain_cond_var; // a worker parked while m_draining
+  CancellationSource m_shutdown_source;
+  atomic<long> m_discarded_tasks;
+  int m_aging_interval;
+  bool m_track_wait_times;
+  WaitStats* m_wait_stats; // m_pool_size + 1 slots
+
+  int m_overflow_policy;
+  int m_block_timeout_ms;
+  atomic<long> m_rejected_tasks;
+  atomic<long> m_dropped_tasks;
+
+  // Worker bookkeeping, m_workers[i] is the worker with index i
+  Mutex m_thread_mutex;
+  std::vector<Worker> m_workers;
+  std::vector<pthread_t> m_retired_threads; // exited, not yet joined
+  atomic<int> m_thread_count;
+  atomic<int> m_peak_thread_count;
+
+  // Work-stealing mode only: one deque per worker, indexed by worker number
+  std::vector<WorkStealingDeque<Task>*> m_local_tasks;
+  atomic<int> m_idle_workers; // workers parked on m_task_cond_var
+};
+
+// Enqueues a whole batch with as few queue operations as the free space
+// allows (normally one) and wakes at most one idle worker per task. When the
+// lane fills up the overflow policy is applied task by task; if it refuses
+// one, the error is returned and that task and the rest stay in the range.
+template <typename Iter>
+int ThreadPool::add_tasks(Iter first, Iter last, int priority, int node)
+{
+  if (first == last) {
+    return 0;
+  }
+  if (refuses()) {
+    m_rejected_tasks.fetch_add(distance(first, last), memory_order_relaxed);
+    return TASK_REJECTED;
+  }
+
+  int lane = lane_for(priority, node);
+  if (stays_local(priority, node)) {
+    WorkStealingDeque<Task>* local = m_local_tasks[current_worker_index()];
+    size_t pushed = 0;
+    while (first != last && local->push(std::move(*first))) {
+      ++first;
+      pushed++;
+    }
+    if (pushed > 0) {
+      TRACE_EVENT(TRACE_ENQUEUE, (int) pushed);
+    }
+    wake_idle_workers(pushed);
+    // whatever did not fit spills over to the global queue below
+  }
+
+  if (m_track_wait_times) {
+    long now = monotonic_ns(); // one clock read for the whole batch
+    for (Iter it = first; it != last; ++it) {
+      it->set_enqueue_time(now);
+    }
+  }
+
+  size_t remaining = distance(first, last);
+  while (remaining > 0) {
+    size_t added = m_lanes[lane]->tasks.try_enqueue_bulk(first, remaining);
+    if (added == 0) {
+      int ret = enqueue_on_overflow(*first, lane);
+      if (ret < 0) {
+        return ret;
+      }
+      if (ret == TASK_QUEUED) {
+        TRACE_EVENT(TRACE_ENQUEUE, 1);
+        wake_idle_workers(1);
+      }
+      ++first;
+      remaining--;
+      continue;
+    }
+    TRACE_EVENT(TRACE_ENQUEUE, (int) added);
+    // wake workers for this part now, they have to make room for the rest
+    wake_idle_workers(added);
+    advance(first, added);
+    remaining -= added;
+  }
+  maybe_spawn_worker();
+
+  return 0;
+}
+
+// Marks a parallel_for chunk as finished if its Task is destroyed without
+// having run (refused or dropped by the overflow policy), so the caller
+// stops waiting for it and runs the chunk itself instead.
+class ChunkGuard
+{
+public:
+  ChunkGuard(atomic<long>* pending) : m_pending(pending) {}
+  ChunkGuard(ChunkGuard&& other) noexcept : m_pending(other.m_pending) { other.m_pending = NULL; }
+  ~ChunkGuard() { release(); }
+  void release()
+  {
+    if (m_pending != NULL) {
+      m_pending->fetch_sub(1, memory_order_release);
+      m_pending = NULL;
+    }
+  }
+private:
+  ChunkGuard(const ChunkGuard&);
+  ChunkGuard& operator=(const ChunkGuard&);
+
+  atomic<long>* m_pending;
+};
+
+// What the chunks of one parallel_for share. It lives on the caller's
+// stack, so the caller must not return (or unwind) before pending is 0.
+// The first exception a chunk throws is kept for the caller to rethrow;
+// chunks that have not started by then are skipped.
+template <typename Function>
+struct ParallelForState
+{
+  ParallelForState(Function* fn, long chunks) : body(fn), pending(chunks), failed(false) {}
+  void run(long begin, long end)
+  {
+    if (failed.load(memory_order_relaxed)) {
+      return;
+    }
+    try {
+      for (long j = begin; j < end; j++) {
+        (*body)(j);
+      }
+    } catch (...) {
+      if (!failed.exchange(true, memory_order_acq_rel)) {
+        error = current_exception(); // published by the chunk's guard.release()
+      }
+    }
+  }
+
+  Function* body;
+  atomic<long> pending; // queued chunks that have not finished
+  atomic<bool> failed;
+  exception_ptr error;
+};
+
+// Calls fn(i) for every i in [begin, end). The range is cut into chunks of
+// grain indices, one Task per chunk, submitted as a single batch. The
+// calling thread runs the first chunk itself and then helps draining the
+// pool until every chunk is done, so it is safe to call from a worker.
+// If fn throws, on whichever thread, the remaining chunks are skipped and
+// the first exception is rethrown here once no chunk is running any more.
+template <typename Function>
+void ThreadPool::parallel_for(long begin, long end, long grain, Function fn)
+{
+  if (end <= begin) {
+    return;
+  }
+  if (grain < 1) {
+    grain = 1;
+  }
+
+  long num_chunks = (end - begin + grain - 1) / grain;
+  ParallelForState<Function> state(&fn, num_chunks - 1);
+  std::vector<char> ran(num_chunks, 0);
+  std::vector<Task> tasks;
+  tasks.reserve(num_chunks - 1);
+  for (long i = 1; i < num_chunks; i++) {
+    long chunk_begin = begin + i * grain;
+    long chunk_end = (chunk_begin + grain < end) ? chunk_begin + grain : end;
+    tasks.push_back(Task([shared = &state, chunk_begin, chunk_end, done = &ran[i],
+                          guard = ChunkGuard(&state.pending)]() mutable {
+      shared->run(chunk_begin, chunk_end);
+      *done = 1;
+      guard.release();
+    }));
+  }
+  add_tasks(tasks.begin(), tasks.end());
+  tasks.clear(); // releases whatever the overflow policy refused
+
+  long first_end = (begin + grain < end) ? begin + grain : end;
+  state.run(begin, first_end);
+
+  while (state.pending.load(memory_order_acquire) > 0) {
+    if (!run_pending_task()) {
+      sched_yield();
+    }
+  }
+
+  for (long i = 1; i < num_chunks; i++) {
+    if (!ran[i]) {
+      long chunk_end = (begin + (i + 1) * grain < end) ? begin + (i + 1) * grain : end;
+      state.run(begin + i * grain, chunk_end);
+    }
+  }
+  if (state.failed.load(memory_order_acquire)) {
+    rethrow_exception(state.error);
+  }
+}
+
+#include "Future.h"
+
+#endif /* _H_THREADPOOL */
@@ -0,0 +1,343 @@
+#include "ThreadPool.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Benchmarks for ThreadPool against a naive std::thread-per-task baseline.
+//
+//   ThreadPool_Bench [-t max_threads] [-n tasks] [-o results.jsonl] [-q]
+//
+// Every workload runs with 1, 2, 4, ... up to max_threads workers (default:
+// the number of online CPUs) in both scheduling modes. A summary goes to
+// stdout; with -o every result is also appended as one JSON object per line,
+// so runs can be compared across commits. -q shrinks the workloads for a
+// quick smoke run.
+
+const int DEFAULT_BENCH_TASKS = 200000;
+const int LATENCY_SAMPLES = 20000;
+const int FIB_N = 24;
+const int FIB_CUTOFF = 14;           // below this fib() runs serially
+const long PARALLEL_FOR_SIZE = 8000000;
+const long PARALLEL_FOR_GRAIN = 20000;
+
+struct BenchConfig
+{
+  int max_threads;
+  int tasks;
+  int latency_samples;
+  int fib_n;
+  long parallel_for_size;
+  FILE* json; // NULL: no machine-readable output
+};
+
+static double seconds_since(long start_ns)
+{
+  return (monotonic_ns() - start_ns) / 1e9;
+}
+
+static const char* mode_name(int scheduling_mode)
+{
+  return scheduling_mode == WORK_STEALING ? "work_stealing" : "global_fifo";
+}
+
+static long percentile(vector<long>& samples, double p)
+{
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = (size_t) (p * (samples.size() - 1));
+  nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+static void report(const BenchConfig& config, const char* bench, const char* impl,
+                   int threads, long ops, double seconds)
+{
+  printf("%-16s %-14s threads %3d  %10.0f ops/s  (%ld ops in %.3f s)\n",
+         bench, impl, threads, ops / seconds, ops, seconds);
+  if (config.json != NULL) {
+    fprintf(config.json, "{\"bench\":\"%s\",\"impl\":\"%s\",\"threads\":%d,"
+            "\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f}\n",
+            bench, impl, threads, ops, seconds, ops / seconds);
+  }
+}
+
+static void report_latency(const BenchConfig& config, const char* bench, const char* impl,
+                           int threads, vector<long>& samples)
+{
+  long p50 = percentile(samples, 0.50);
+  long p99 = percentile(samples, 0.99);
+  long p999 = percentile(samples, 0.999);
+  printf("%-16s %-14s threads %3d  p50 %8ld ns  p99 %8ld ns  p999 %8ld ns\n",
+         bench, impl, threads, p50, p99, p999);
+  if (config.json != NULL) {
+    fprintf(config.json, "{\"bench\":\"%s\",\"impl\":\"%s\",\"threads\":%d,"
+            "\"samples\":%zu,\"p50_ns\":%ld,\"p99_ns\":%ld,\"p999_ns\":%ld}\n",
+            bench, impl, threads, samples.size(), p50, p99, p999);
+  }
+}
+
+// The main thread is not a worker, it waits by yielding so it does not
+// compete with the workers for a core.
+static void wait_until(const atomic<long>& counter, long target)
+{
+  while (counter.load(memory_order_acquire) < target) {
+    sched_yield();
+  }
+}
+
+// Empty tasks, one add_task() each and then one add_tasks() batch
+static void bench_throughput(const BenchConfig& config, ThreadPool& pool, int threads,
+                             int scheduling_mode)
+{
+  atomic<long> done(0);
+  long start = monotonic_ns();
+  for (int i = 0; i < config.tasks; i++) {
+    pool.add_task([&done] { done.fetch_add(1, memory_order_relaxed); });
+  }
+  wait_until(done, config.tasks);
+  report(config, "throughput", mode_name(scheduling_mode), threads, config.tasks,
+         seconds_since(start));
+
+  done = 0;
+  vector<Task> batch;
+  batch.reserve(config.tasks);
+  start = monotonic_ns();
+  for (int i = 0; i < config.tasks; i++) {
+    batch.push_back(Task([&done] { done.fetch_add(1, memory_order_relaxed); }));
+  }
+  pool.add_tasks(batch.begin(), batch.end());
+  wait_until(done, config.tasks);
+  report(config, "throughput_bulk", mode_name(scheduling_mode), threads, config.tasks,
+         seconds_since(start));
+}
+
+// Submit-to-start latency. "latency_idle" submits the next task only after
+// the previous one ran, so it measures how fast an idle pool wakes up;
+// "latency_loaded" submits everything back to back, so it includes queueing.
+static void bench_latency(const BenchConfig& config, ThreadPool& pool, int threads,
+                          int scheduling_mode)
+{
+  vector<long> samples(config.latency_samples);
+  atomic<long> done(0);
+  for (int i = 0; i < config.latency_samples; i++) {
+    long submitted = monotonic_ns();
+    pool.add_task([&samples, &done, i, submitted] {
+      samples[i] = monotonic_ns() - submitted;
+      done.fetch_add(1, memory_order_release);
+    });
+    wait_until(done, i + 1);
+  }
+  report_latency(config, "latency_idle", mode_name(scheduling_mode), threads, samples);
+
+  done = 0;
+  for (int i = 0; i < config.latency_samples; i++) {
+    long submitted = monotonic_ns();
+    pool.add_task([&samples, &done, i, submitted] {
+      samples[i] = monotonic_ns() - submitted;
+      done.fetch_add(1, memory_order_release);
+    });
+  }
+  wait_until(done, config.latency_samples);
+  report_latency(config, "latency_loaded", mode_name(scheduling_mode), threads, samples);
+}
+
+static long fib_serial(int n)
+{
+  return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+// Fork-join: every call above the cutoff forks fib(n - 1) as a task and
+// joins it after computing fib(n - 2) itself.
+static long fib_pool(ThreadPool& pool, int n)
+{
+  if (n < FIB_CUTOFF) {
+    return fib_serial(n);
+  }
+  Future<long> left = pool.submit([&pool, n] { return fib_pool(pool, n - 1); });
+  long right = fib_pool(pool, n - 2);
+  return left.get() + right;
+}
+
+static long fib_forks(int n)
+{
+  return n < FIB_CUTOFF ? 0 : 1 + fib_forks(n - 1) + fib_forks(n - 2);
+}
+
+static void bench_fork_join(const BenchConfig& config, ThreadPool& pool, int threads,
+                            int scheduling_mode)
+{
+  long start = monotonic_ns();
+  long result = pool.submit([&pool, &config] { return fib_pool(pool, config.fib_n); }).get();
+  double seconds = seconds_since(start);
+  if (result != fib_serial(config.fib_n)) {
+    fprintf(stderr, "fork_join: wrong result %ld\n", result);
+  }
+  report(config, "fork_join", mode_name(scheduling_mode), threads, fib_forks(config.fib_n),
+         seconds);
+}
+
+static void bench_parallel_for(const BenchConfig& config, ThreadPool& pool, int threads,
+                               int scheduling_mode)
+{
+  vector<double> data(config.parallel_for_size);
+  long start = monotonic_ns();
+  pool.parallel_for(0, config.parallel_for_size, PARALLEL_FOR_GRAIN, [&data](long i) {
+    data[i] = sqrt((double) i);
+  });
+  report(config, "parallel_for", mode_name(scheduling_mode), threads,
+         config.parallel_for_size, seconds_since(start));
+}
+
+static void run_pool_benchmarks(const BenchConfig& config, int threads, int scheduling_mode)
+{
+  ThreadPool pool(threads, scheduling_mode, config.tasks);
+  if (pool.initialize_threadpool() != 0) {
+    fprintf(stderr, "failed to start a pool of %d threads\n", threads);
+    return;
+  }
+  bench_throughput(config, pool, threads, scheduling_mode);
+  bench_latency(config, pool, threads, scheduling_mode);
+  bench_fork_join(config, pool, threads, scheduling_mode);
+  bench_parallel_for(config, pool, threads, scheduling_mode);
+  pool.destroy_threadpool();
+}
+
+// The baseline runs at most threads tasks at a time, each on a new
+// std::thread, joining a whole wave before starting the next.
+template <typename Function>
+static void run_in_threads(int count, int threads, Function fn)
+{
+  vector<thread> wave;
+  for (int i = 0; i < count; i += threads) {
+    int end = min(i + threads, count);
+    for (int j = i; j < end; j++) {
+      wave.push_back(thread(fn, j));
+    }
+    for (size_t j = 0; j < wave.size(); j++) {
+      wave[j].join();
+    }
+    wave.clear();
+  }
+}
+
+static long fib_threads(int n)
+{
+  if (n < FIB_CUTOFF) {
+    return fib_serial(n);
+  }
+  long left;
+  thread fork([&left, n] { left = fib_threads(n - 1); });
+  long right = fib_threads(n - 2);
+  fork.join();
+  return left + right;
+}
+
+static void run_baseline_benchmarks(const BenchConfig& config, int threads)
+{
+  // thread creation is ~1000x slower than a queued task, keep this bounded
+  int tasks = min(config.tasks, 20000);
+  atomic<long> done(0);
+  long start = monotonic_ns();
+  run_in_threads(tasks, threads, [&done](int) { done.fetch_add(1, memory_order_relaxed); });
+  report(config, "throughput", "std_thread", threads, tasks, seconds_since(start));
+
+  int samples_count = min(config.latency_samples, 5000);
+  vector<long> samples(samples_count);
+  for (int i = 0; i < samples_count; i++) {
+    long submitted = monotonic_ns();
+    thread t([&samples, i, submitted] { samples[i] = monotonic_ns() - submitted; });
+    t.join();
+  }
+  report_latency(config, "latency_idle", "std_thread", threads, samples);
+
+  start = monotonic_ns();
+  long result = fib_threads(config.fib_n);
+  double seconds = seconds_since(start);
+  if (result != fib_serial(config.fib_n)) {
+    fprintf(stderr, "fork_join: wrong result %ld\n", result);
+  }
+  report(config, "fork_join", "std_thread", threads, fib_forks(config.fib_n), seconds);
+
+  vector<double> data(config.parallel_for_size);
+  int chunks = (int) ((config.parallel_for_size + PARALLEL_FOR_GRAIN - 1) / PARALLEL_FOR_GRAIN);
+  start = monotonic_ns();
+  run_in_threads(chunks, threads, [&data, &config](int chunk) {
+    long end = min((chunk + 1) * PARALLEL_FOR_GRAIN, config.parallel_for_size);
+    for (long i = chunk * PARALLEL_FOR_GRAIN; i < end; i++) {
+      data[i] = sqrt((double) i);
+    }
+  });
+  report(config, "parallel_for", "std_thread", threads, config.parallel_for_size,
+         seconds_since(start));
+}
+
+int main(int argc, char* argv[])
+{
+  BenchConfig config;
+  config.max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  config.tasks = DEFAULT_BENCH_TASKS;
+  config.latency_samples = LATENCY_SAMPLES;
+  config.fib_n = FIB_N;
+  config.parallel_for_size = PARALLEL_FOR_SIZE;
+  config.json = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:o:q")) != -1) {
+    switch (opt) {
+    case 't':
+      config.max_threads = atoi(optarg);
+      break;
+    case 'n':
+      config.tasks = atoi(optarg);
+      break;
+    case 'o':
+      config.json = fopen(optarg, "a");
+      if (config.json == NULL) {
+        fprintf(stderr, "cannot open %s: %s\n", optarg, strerror(errno));
+        return 1;
+      }
+      break;
+    case 'q':
+      config.tasks = 10000;
+      config.latency_samples = 1000;
+      config.fib_n = 18;
+      config.parallel_for_size = 400000;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t max_threads] [-n tasks] [-o results.jsonl] [-q]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (config.max_threads < 1 || config.tasks < 1) {
+    fprintf(stderr, "-t and -n must be positive\n");
+    return 1;
+  }
+
+  for (int threads = 1; ; threads *= 2) {
+    if (threads > config.max_threads) {
+      threads = config.max_threads;
+    }
+    run_pool_benchmarks(config, threads, GLOBAL_FIFO);
+    run_pool_benchmarks(config, threads, WORK_STEALING);
+    run_baseline_benchmarks(config, threads);
+    if (threads == config.max_threads) {
+      break;
+    }
+  }
+
+  if (config.json != NULL) {
+    fclose(config.json);
+  }
+  return 0;
+}
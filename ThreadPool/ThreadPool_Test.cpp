@@ -1,4 +1,7 @@
-#include "threadpool.h"
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+
+#include <unistd.h>
 
 #include <iostream>
 
@@ -6,16 +9,15 @@ using namespace std;
 
 const int MAX_TASKS = 4;
 
-void hello(void* arg)
+void hello(int x)
 {
-  int* x = (int*) arg;
-  cout << "Hello " << *x << endl;
+  cout << "Hello " << x << endl;
 //  cout << "\n";
 }
 
 int main(int argc, char* argv[])
 {
-  ThreadPool tp(2);
+  ThreadPool tp(2, argc > 1 ? WORK_STEALING : GLOBAL_FIFO);
   int ret = tp.initialize_threadpool();
   if (ret == -1) {
     cerr << "Failed to initialize thread pool!" << endl;
@@ -23,19 +25,74 @@ int main(int argc, char* argv[])
   }
 
   for (int i = 0; i < MAX_TASKS; i++) {
-    int* x = new int();
-    *x = i+1;
-    Task* t = new Task(&hello, (void*) x);
+    // the lambda and its capture live inside the Task, nothing to delete
+    int x = i+1;
 //    cout << "Adding to pool, task " << i+1 << endl;
-    tp.add_task(t);
+    tp.add_task([x] { hello(x); });
 //    cout << "Added to pool, task " << i+1 << endl;
   }
 
-  sleep(2);
+  // urgent work is taken ahead of everything queued at normal priority
+  tp.add_task([] { hello(0); }, PRIORITY_HIGH);
+
+  // submit() hands back a Future, then() chains work on the completing worker
+  Future<int> sum = tp.submit([](int a, int b) { return a + b; }, 20, 1)
+                      .then([](int x) { return x * 2; });
+  cout << "Future result " << sum.get() << endl;
+
+  // finish whatever is still queued instead of sleeping and hoping it ran
+  tp.shutdown(SHUTDOWN_DRAIN, 2000);
 
-  tp.destroy_threadpool();
+  // Per-node lanes on any box: fake_topology.txt describes two NUMA nodes.
+  // Tasks queued before the workers start stay on the node they were sent to.
+  ThreadPoolOptions numa;
+  numa.min_threads = 4;
+  numa.max_threads = 4;
+  numa.numa_aware = true;
+  numa.topology_file = "fake_topology.txt";
+  ThreadPool np(numa);
+  for (int node = 0; node < np.get_node_count(); node++) {
+    for (int i = 0; i <= node; i++) {
+      np.add_task([node] { hello(100 + node); }, PRIORITY_NORMAL, node);
+    }
+    cout << "Node " << node << " of " << np.get_node_count() << " has "
+         << np.get_node_queue_depth(node) << " tasks queued" << endl;
+  }
+  np.initialize_threadpool();
+  np.shutdown(SHUTDOWN_DRAIN, 2000);
+
+  // A graph that fans out wider than the queue: nodes the pool refuses run
+  // on the thread that made them ready instead of failing the run
+  ThreadPoolOptions tight;
+  tight.min_threads = 2;
+  tight.max_threads = 2;
+  tight.queue_capacity = 2;
+  tight.overflow_policy = OVERFLOW_FAIL;
+  ThreadPool gp(tight);
+  gp.initialize_threadpool();
+  TaskGraph graph;
+  atomic<int> ran(0);
+  TaskGraph::NodeId root = graph.add_node([&ran] { ran++; });
+  for (int i = 0; i < 20; i++) {
+    graph.add_edge(root, graph.add_node([&ran] { ran++; }));
+  }
+  graph.run(gp);
+  cout << "Graph ran " << ran << " of " << graph.size() << " nodes" << endl;
+  gp.shutdown(SHUTDOWN_DRAIN, 2000);
 
-  // TODO: delete worker objects
+  // An elastic pool with no minimum: the first task starts a worker, which
+  // retires again when idle, and the next task starts another one
+  ThreadPoolOptions elastic;
+  elastic.min_threads = 0;
+  elastic.max_threads = 4;
+  elastic.idle_timeout_ms = 50;
+  ThreadPool ep(elastic);
+  ep.initialize_threadpool();
+  cout << "Elastic result " << ep.submit([] { return 1; }).get();
+  usleep(300 * 1000);
+  cout << ", " << ep.get_thread_count() << " threads after idling, then "
+       << ep.submit([] { return 2; }).get() << endl;
+  ep.shutdown(SHUTDOWN_DRAIN, 2000);
 
   cout << "Exiting app..." << endl;
 
@@ -0,0 +1,148 @@
+#include "Topology.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+CpuTopology::CpuTopology()
+{
+}
+
+int CpuTopology::load(const char* topology_file)
+{
+  m_node_cpus.clear();
+  m_cpu_node.clear();
+
+  int ret = (topology_file == NULL) ? load_sysfs() : load_file(topology_file);
+  if (ret != 0 || m_node_cpus.empty()) {
+    m_node_cpus.clear();
+    m_cpu_node.clear();
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    vector<int> cpus;
+    for (long i = 0; i < (online > 0 ? online : 1); i++) {
+      cpus.push_back((int) i);
+    }
+    add_node(cpus);
+    return -1;
+  }
+  return 0;
+}
+
+int CpuTopology::node_of_cpu(int cpu) const
+{
+  if (cpu < 0 || cpu >= (int) m_cpu_node.size() || m_cpu_node[cpu] < 0) {
+    return 0;
+  }
+  return m_cpu_node[cpu];
+}
+
+int CpuTopology::load_sysfs()
+{
+  DIR* dir = opendir(SYSFS_NODE_PATH);
+  if (dir == NULL) {
+    return -1;
+  }
+  vector<int> ids;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int id;
+    char rest;
+    if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1) {
+      ids.push_back(id);
+    }
+  }
+  closedir(dir);
+  sort(ids.begin(), ids.end());
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", SYSFS_NODE_PATH, ids[i]);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+      return -1;
+    }
+    char line[4096];
+    vector<int> cpus;
+    bool ok = fgets(line, sizeof(line), file) != NULL && parse_cpulist(line, cpus);
+    fclose(file);
+    if (!ok) {
+      return -1;
+    }
+    if (!cpus.empty()) { // memory-only nodes have no CPUs to run workers on
+      add_node(cpus);
+    }
+  }
+  return 0;
+}
+
+int CpuTopology::load_file(const char* topology_file)
+{
+  FILE* file = fopen(topology_file, "r");
+  if (file == NULL) {
+    return -1;
+  }
+  char line[4096];
+  int ret = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    vector<int> cpus;
+    if (!parse_cpulist(line, cpus)) {
+      ret = -1;
+      break;
+    }
+    if (!cpus.empty()) {
+      add_node(cpus);
+    }
+  }
+  fclose(file);
+  return ret;
+}
+
+void CpuTopology::add_node(const vector<int>& cpus)
+{
+  int node = (int) m_node_cpus.size();
+  m_node_cpus.push_back(cpus);
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] >= (int) m_cpu_node.size()) {
+      m_cpu_node.resize(cpus[i] + 1, -1);
+    }
+    m_cpu_node[cpus[i]] = node;
+  }
+}
+
+bool parse_cpulist(const char* text, vector<int>& cpus)
+{
+  const char* p = text;
+  while (*p != '\0' && !isspace((unsigned char) *p)) {
+    if (!isdigit((unsigned char) *p)) {
+      return false;
+    }
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (!isdigit((unsigned char) *p)) {
+        return false;
+      }
+      last = strtol(p, &end, 10);
+      p = end;
+    }
+    if (last < first) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back((int) cpu);
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0' && !isspace((unsigned char) *p)) {
+      return false;
+    }
+  }
+  return true;
+}
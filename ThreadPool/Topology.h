@@ -0,0 +1,40 @@
+#ifndef _H_TOPOLOGY
+#define _H_TOPOLOGY
+
+#include <vector>
+
+using namespace std;
+
+const char* const SYSFS_NODE_PATH = "/sys/devices/system/node";
+
+// Which CPUs belong to which NUMA node. Nodes are numbered 0..node_count()-1
+// in ascending order of their kernel node id.
+// load(NULL) reads the machine's topology from sysfs. load(file) reads a
+// fake one instead, one line per node holding the node's CPUs in the kernel's
+// cpulist format, e.g.
+//   0-3,8-11
+//   4-7,12-15
+// so NUMA placement can be exercised on a single-node box.
+class CpuTopology
+{
+public:
+  CpuTopology();
+  // Returns -1 if nothing usable was found; the topology is then one node
+  // holding every online CPU.
+  int load(const char* topology_file);
+  int node_count() const { return (int) m_node_cpus.size(); }
+  const vector<int>& cpus(int node) const { return m_node_cpus[node]; }
+  int node_of_cpu(int cpu) const; // 0 for CPUs it does not know
+private:
+  int load_sysfs();
+  int load_file(const char* topology_file);
+  void add_node(const vector<int>& cpus);
+
+  vector<vector<int> > m_node_cpus;
+  vector<int> m_cpu_node; // indexed by CPU number
+};
+
+// Parses a cpulist such as "0-3,8,10-11"; returns false on malformed input
+bool parse_cpulist(const char* text, vector<int>& cpus);
+
+#endif /* _H_TOPOLOGY */
@@ -0,0 +1,152 @@
+#include "Trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <vector>
+
+// Buffers outlive their threads (the dump still wants their events). Once
+// flushed, the buffers of exited threads move from s_buffers to s_free_buffers
+// for reuse; they are never freed.
+static pthread_mutex_t s_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceBuffer*> s_buffers; // in registration order
+static std::vector<TraceBuffer*> s_free_buffers;
+static int s_retired_count = 0; // retired buffers in s_buffers
+
+static const char* const s_event_names[NUM_TRACE_EVENTS] = {
+  "enqueue", "dequeue", "steal", "task", "task", "park", "unpark"
+};
+
+// Must be called with s_registry_lock held
+static void recycle_retired_buffers()
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < s_buffers.size(); i++) {
+    if (s_buffers[i]->retired) {
+      s_free_buffers.push_back(s_buffers[i]);
+    } else {
+      s_buffers[kept++] = s_buffers[i];
+    }
+  }
+  s_buffers.resize(kept);
+  s_retired_count = 0;
+}
+
+#ifdef THREADPOOL_TRACING
+
+static int s_next_thread_id = 0;
+
+// Hands the thread's buffer back when the thread exits
+struct TraceThreadExit
+{
+  ~TraceThreadExit();
+  TraceBuffer* buffer;
+};
+
+static thread_local TraceThreadExit t_trace_exit = { NULL };
+
+TraceThreadExit::~TraceThreadExit()
+{
+  if (buffer == NULL) {
+    return;
+  }
+  t_trace_buffer = NULL;
+  pthread_mutex_lock(&s_registry_lock);
+  buffer->retired = true;
+  if (++s_retired_count > TRACE_MAX_RETIRED_BUFFERS) {
+    // nobody dumps, give up the events of the oldest exited thread
+    for (size_t i = 0; i < s_buffers.size(); i++) {
+      if (s_buffers[i]->retired) {
+        s_free_buffers.push_back(s_buffers[i]);
+        s_buffers.erase(s_buffers.begin() + i);
+        s_retired_count--;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&s_registry_lock);
+}
+
+TraceBuffer* trace_register_thread()
+{
+  TraceBuffer* buffer = NULL;
+  pthread_mutex_lock(&s_registry_lock);
+  if (!s_free_buffers.empty()) {
+    buffer = s_free_buffers.back();
+    s_free_buffers.pop_back();
+  }
+  pthread_mutex_unlock(&s_registry_lock);
+  if (buffer == NULL) {
+    buffer = new TraceBuffer;
+  }
+  // the dump only reads events below position, stale ones stay hidden
+  buffer->position.store(0, memory_order_relaxed);
+  buffer->retired = false;
+
+  pthread_mutex_lock(&s_registry_lock);
+  buffer->thread_id = s_next_thread_id++;
+  s_buffers.push_back(buffer);
+  pthread_mutex_unlock(&s_registry_lock);
+  t_trace_buffer = buffer;
+  t_trace_exit.buffer = buffer;
+  return buffer;
+}
+
+#endif /* THREADPOOL_TRACING */
+
+void trace_clear()
+{
+  pthread_mutex_lock(&s_registry_lock);
+  recycle_retired_buffers();
+  for (size_t i = 0; i < s_buffers.size(); i++) {
+    s_buffers[i]->position.store(0, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&s_registry_lock);
+}
+
+// Task start/end become a duration ("B"/"E") per thread, everything else an
+// instant event carrying arg. Timestamps are in microseconds.
+static void write_event(FILE* file, int thread_id, const TraceEvent& event)
+{
+  const char* phase = "i";
+  if (event.type == TRACE_TASK_START) {
+    phase = "B";
+  } else if (event.type == TRACE_TASK_END) {
+    phase = "E";
+  }
+  fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%ld.%03ld,\"pid\":1,\"tid\":%d",
+          s_event_names[event.type], phase, event.timestamp_ns / 1000,
+          event.timestamp_ns % 1000, thread_id);
+  if (phase[0] == 'i') {
+    fprintf(file, ",\"s\":\"t\",\"args\":{\"arg\":%d}", event.arg);
+  }
+  fprintf(file, "}");
+}
+
+int trace_dump_chrome(const char* path)
+{
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    return -1;
+  }
+  fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"args\":{\"name\":\"ThreadPool\"}}");
+
+  pthread_mutex_lock(&s_registry_lock);
+  for (size_t i = 0; i < s_buffers.size(); i++) {
+    const TraceBuffer* buffer = s_buffers[i];
+    unsigned long end = buffer->position.load(memory_order_acquire);
+    unsigned long begin = end > (unsigned long) TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+    for (unsigned long pos = begin; pos < end; pos++) {
+      const TraceEvent& event = buffer->events[pos & (TRACE_BUFFER_SIZE - 1)];
+      if (event.type >= 0 && event.type < NUM_TRACE_EVENTS) {
+        write_event(file, buffer->thread_id, event);
+      }
+    }
+  }
+  recycle_retired_buffers(); // their threads are gone, nothing more to come
+  pthread_mutex_unlock(&s_registry_lock);
+
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,88 @@
+#ifndef _H_TRACE
+#define _H_TRACE
+
+#include <atomic>
+
+#include "Platform.h"
+
+using namespace std;
+
+// Scheduler tracing. Build with -DTHREADPOOL_TRACING to record events, without
+// it TRACE_EVENT() expands to nothing and its arguments are not evaluated.
+//
+// Every thread records into its own ring buffer of TRACE_BUFFER_SIZE events,
+// so recording is a clock read and a few plain stores, no lock and no shared
+// cache line. When a buffer wraps the oldest events are overwritten.
+// trace_dump_chrome() writes everything recorded so far as Chrome trace JSON
+// (load it in chrome://tracing or ui.perfetto.dev). Dump while the traced
+// threads are quiet, e.g. after destroy_threadpool(): events recorded during
+// the dump may come out garbled.
+//
+// A thread's buffer is kept after the thread exits, the dump still wants its
+// events. Once it has been dumped (or cleared) it goes to a free list for the
+// next thread that registers, so elastic workers coming and going do not
+// grow the registry. Of the exited threads that were never dumped only the
+// last TRACE_MAX_RETIRED_BUFFERS are kept, older ones are recycled.
+
+// Event types, arg is type specific
+const int TRACE_ENQUEUE = 0;    // arg: number of tasks queued
+const int TRACE_DEQUEUE = 1;    // arg: global lane it came from, -1 own deque
+const int TRACE_STEAL = 2;      // arg: worker it was stolen from
+const int TRACE_TASK_START = 3;
+const int TRACE_TASK_END = 4;
+const int TRACE_PARK = 5;       // worker goes to sleep
+const int TRACE_UNPARK = 6;     // and wakes up again
+const int NUM_TRACE_EVENTS = 7;
+
+const int TRACE_BUFFER_SIZE = 1 << 16; // events per thread, a power of two
+const int TRACE_MAX_RETIRED_BUFFERS = 64;
+
+struct TraceEvent
+{
+  long timestamp_ns; // monotonic_ns()
+  int type;
+  int arg;
+};
+
+struct TraceBuffer
+{
+  int thread_id; // registration order, the "tid" in the dump
+  atomic<unsigned long> position; // events ever recorded
+  bool retired; // its thread exited, guarded by the registry lock
+  TraceEvent events[TRACE_BUFFER_SIZE];
+};
+
+// Both work without THREADPOOL_TRACING too, there is just nothing to dump.
+// trace_dump_chrome() returns -1 if path cannot be written.
+int trace_dump_chrome(const char* path);
+void trace_clear(); // forget everything recorded so far
+
+#ifdef THREADPOOL_TRACING
+
+TraceBuffer* trace_register_thread();
+
+inline thread_local TraceBuffer* t_trace_buffer = NULL;
+
+inline void trace_event(int type, int arg)
+{
+  TraceBuffer* buffer = t_trace_buffer;
+  if (buffer == NULL) {
+    buffer = trace_register_thread();
+  }
+  unsigned long pos = buffer->position.load(memory_order_relaxed);
+  TraceEvent& event = buffer->events[pos & (TRACE_BUFFER_SIZE - 1)];
+  event.timestamp_ns = monotonic_ns();
+  event.type = type;
+  event.arg = arg;
+  buffer->position.store(pos + 1, memory_order_release);
+}
+
+#define TRACE_EVENT(type, arg) trace_event((type), (arg))
+
+#else
+
+#define TRACE_EVENT(type, arg) ((void) 0)
+
+#endif /* THREADPOOL_TRACING */
+
+#endif /* _H_TRACE */
@@ -0,0 +1,156 @@
+#ifndef _H_WORKSTEALINGDEQUE
+#define _H_WORKSTEALINGDEQUE
+
+#include <atomic>
+#include <utility>
+
+#include "Platform.h"
+
+using namespace std;
+
+const int DEFAULT_DEQUE_CAPACITY = 1024;
+
+// Chase-Lev work-stealing deque with a fixed capacity, holding its elements
+// by value.
+// Only the owning worker may call push() and pop(); they work on the bottom
+// end in LIFO order so the owner keeps running what it just produced (hot in
+// cache). Any other thread may call steal(), which takes from the top end in
+// FIFO order. When the deque is full push() fails and the caller is expected
+// to spill the element to the pool's global queue.
+//
+// Classic Chase-Lev copies the element out before claiming it, which is only
+// safe for trivially copyable types. Here the winner of the claim moves the
+// element out afterwards and then marks its slot empty; push() refuses to
+// reuse a slot that a slow thief is still moving out of.
+template <typename T>
+class WorkStealingDeque
+{
+public:
+  WorkStealingDeque(int capacity = DEFAULT_DEQUE_CAPACITY);
+  ~WorkStealingDeque();
+  bool push(T&& value);
+  bool pop(T& value);
+  bool steal(T& value);
+  bool empty() const;
+private:
+  WorkStealingDeque(const WorkStealingDeque&);
+  WorkStealingDeque& operator=(const WorkStealingDeque&);
+
+  struct Slot
+  {
+    atomic<bool> full;
+    T value;
+  };
+
+  void take(long index, T& value);
+
+  // top and bottom live on separate cache lines, thieves only hammer m_top
+  alignas(CACHE_LINE_SIZE) atomic<long> m_top;
+  alignas(CACHE_LINE_SIZE) atomic<long> m_bottom;
+  alignas(CACHE_LINE_SIZE) long m_mask;
+  Slot* m_buffer;
+};
+
+template <typename T>
+WorkStealingDeque<T>::WorkStealingDeque(int capacity) : m_top(0), m_bottom(0)
+{
+  // round the capacity up to a power of two so we can mask instead of mod
+  long size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  m_mask = size - 1;
+  m_buffer = new Slot[size];
+  for (long i = 0; i < size; i++) {
+    m_buffer[i].full.store(false, memory_order_relaxed);
+  }
+}
+
+template <typename T>
+WorkStealingDeque<T>::~WorkStealingDeque()
+{
+  delete[] m_buffer;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::push(T&& value)
+{
+  long b = m_bottom.load(memory_order_relaxed);
+  long t = m_top.load(memory_order_acquire);
+  Slot& slot = m_buffer[b & m_mask];
+  if (b - t > m_mask || slot.full.load(memory_order_acquire)) {
+    return false; // full, or a thief is still moving out of this slot
+  }
+  slot.value = std::move(value);
+  slot.full.store(true, memory_order_relaxed);
+  // publish the slot before the new bottom becomes visible to thieves
+  m_bottom.store(b + 1, memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::pop(T& value)
+{
+  long b = m_bottom.load(memory_order_relaxed) - 1;
+  m_bottom.store(b, memory_order_relaxed);
+  // the store to m_bottom must be ordered before the load of m_top, otherwise
+  // the owner and a thief could both take the last element
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = m_top.load(memory_order_relaxed);
+
+  if (t > b) {
+    // deque was already empty, restore bottom
+    m_bottom.store(b + 1, memory_order_relaxed);
+    return false;
+  }
+
+  if (t == b) {
+    // last element: race against thieves for it
+    bool won = m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                             memory_order_relaxed);
+    m_bottom.store(b + 1, memory_order_relaxed);
+    if (!won) {
+      return false; // a thief got it first
+    }
+  }
+  take(b, value);
+  return true;
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::steal(T& value)
+{
+  long t = m_top.load(memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = m_bottom.load(memory_order_acquire);
+
+  if (t >= b) {
+    return false; // empty
+  }
+  if (!m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                     memory_order_relaxed)) {
+    return false; // lost the race against the owner or another thief
+  }
+  take(t, value);
+  return true;
+}
+
+// Moves the element at index out; the caller has exclusively claimed it.
+template <typename T>
+void WorkStealingDeque<T>::take(long index, T& value)
+{
+  Slot& slot = m_buffer[index & m_mask];
+  value = std::move(slot.value);
+  slot.value = T(); // release whatever the moved-from value still holds
+  slot.full.store(false, memory_order_release);
+}
+
+template <typename T>
+bool WorkStealingDeque<T>::empty() const
+{
+  long t = m_top.load(memory_order_acquire);
+  long b = m_bottom.load(memory_order_acquire);
+  return b <= t;
+}
+
+#endif /* _H_WORKSTEALINGDEQUE */